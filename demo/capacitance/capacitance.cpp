@@ -21,6 +21,10 @@
  *
  * This demo shows how to obtain the capacitance of two concentric spheres. The
  * space between the spheres is assumed to be empty. 
+ *
+ * The potential of a floating sphere is then solved for with and without
+ * deflating the Krylov solver by the Laplace solution, showing the reduction
+ * in the number of iterations.
  */
 
 #include <punc.h>
@@ -61,10 +65,49 @@ int main()
 	/***************************************************************************
 	 * CALCULATE THE CAPACITANCE AND PRINT THE RESULT
 	 **************************************************************************/
-	boost_matrix inv_capacity = inv_capacitance(V, objects, mesh, eps0);
+	auto laplace_solutions = laplace_solver(V, objects, mesh, eps0);
+	boost_matrix inv_capacity = inv_capacitance(laplace_solutions, mesh, eps0);
 
 	auto error = (cap - 1. / inv_capacity(0, 0)) * inv_capacity(0, 0);
 	printf("Analatical value: %f, numerical value: %f, error: %f\n", cap, 1. / inv_capacity(0, 0), error);
 
+	/***************************************************************************
+	 * SOLVE FOR A FLOATING SPHERE WITH AND WITHOUT DEFLATION
+	 *
+	 * The sphere is given the analytical charge of a unit potential, and the
+	 * potential is solved for with the BC-method. The Laplace solution above
+	 * spans the mode tied to the sphere's potential, and deflating it should
+	 * reduce the number of iterations.
+	 **************************************************************************/
+	auto u0 = std::make_shared<df::Constant>(0.0);
+	df::DirichletBC bc(std::make_shared<df::FunctionSpace>(V), u0,
+					   std::make_shared<df::MeshFunction<size_t>>(mesh.bnd), mesh.ext_bnd_id);
+	std::vector<df::DirichletBC> ext_bc = {bc};
+
+	df::Function phi(std::make_shared<const df::FunctionSpace>(V));
+	df::Function rho(std::make_shared<const df::FunctionSpace>(V));
+
+	for (bool deflate : {false, true})
+	{
+		std::vector<std::shared_ptr<Object>> floating;
+		floating.push_back(std::make_shared<ObjectBC>(V, mesh, 2, eps0));
+		floating[0]->charge = cap;
+		auto circuit = std::make_shared<CircuitBC>(V, floating, VSourceVector(),
+												   ISourceVector(), 1.0, eps0);
+
+		PoissonSolver poisson(V, floating, ext_bc, circuit, eps0, false,
+							  "gmres", "hypre_amg");
+		if (deflate)
+		{
+			poisson.set_deflation(laplace_solutions);
+		}
+		*phi.vector() = 0.0;
+		poisson.solve_circuit(phi, rho, mesh, floating, circuit);
+
+		printf("Deflation: %s, iterations: %zu, potential: %f\n",
+			   deflate ? "yes" : "no ", poisson.stats.iterations,
+			   floating[0]->get_potential());
+	}
+
 	return 0;
 }
@@ -107,7 +107,7 @@ int main()
         num_particles_outside[i-1] = tot_num0-tot_num1;
         
         timer.tic("injector");
-        inject_particles(pop, species, mesh.exterior_facets, dt);
+        inject_particles(pop, species, mesh.exterior_facets, dt, i);
         timer.toc();
 
         auto tot_num2 = pop.num_of_particles();
@@ -118,6 +118,7 @@ int main()
 
         timer.progress(i, steps, 0, override_status_print);
         std::cout << ", total number of particles: "<<num_tot[i];
+        Profiler::instance().step(i);
     }
     std::cout << '\n';
     timer.summary();
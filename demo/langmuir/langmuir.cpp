@@ -279,6 +279,7 @@ int main()
         timer.toc();
 
         t += dt;
+        Profiler::instance().step(i);
     }   
 
     if (override_status_print)
@@ -23,6 +23,7 @@
 #include <punc.h>
 #include <dolfin.h>
 #include <csignal>
+#include <sstream>
 
 using namespace punc;
 namespace po = boost::program_options;
@@ -41,6 +42,8 @@ using std::make_shared;
 const char* fname_hist  = "history.dat";
 const char* fname_state = "state.dat";
 const char* fname_pop   = "population.dat";
+const char* fname_cap   = "capacitance.dat";
+const char* fname_setup = "setup.dat";
 const bool override_status_print = true;
 const double tol = 1e-14;
 
@@ -78,6 +81,13 @@ int run(const Options &opt)
     PhysicalConstants constants;
     double eps0 = constants.eps0;
 
+    // Particles loaded and injected are reproducible for a given seed, also
+    // across restarts and numbers of threads
+    unsigned long long seed = get_seed();
+    opt.get("seed", seed, true);
+    set_seed(seed);
+    cout << "  Seed: " << seed << endl;
+
     /***************************************************************************
      * SETUP MESH AND FIELDS
      **************************************************************************/
@@ -91,7 +101,34 @@ int run(const Options &opt)
     auto W = CG1_vector_space(mesh);
     auto Q = DG0_space(mesh);
     auto P = DG0_vector_space(mesh);
-    auto dv_inv = element_volume(V);
+
+    // Quantities depending only on the mesh, species, objects and circuitry
+    // are cached between runs
+    bool cache_setup = true;
+    opt.get("cache_setup", cache_setup, true);
+
+    std::shared_ptr<SetupCache> setup_cache;
+    if(cache_setup){
+        auto key = setup_key(V, mesh);
+        boost::hash_combine(key, opt.hash({"B", "species.", "objects."}));
+
+        // Tabulated distributions may change without changing the options
+        vector<string> vdf_files;
+        opt.get_repeated("species.vdf_file", vdf_files, 0, true);
+        for(auto &fname : vdf_files){
+            ifstream file(fname);
+            std::stringstream content;
+            content << file.rdbuf();
+            boost::hash_combine(key, content.str());
+        }
+        setup_cache = make_shared<SetupCache>(fname_setup, key, mesh.mesh->mpi_comm());
+    }
+
+    vector<double> dv_inv;
+    if(!setup_cache || !setup_cache->get("dv_inv", dv_inv)){
+        dv_inv = element_volume(V);
+        if(setup_cache) setup_cache->set("dv_inv", dv_inv);
+    }
 
     // The electric potential and electric field
     df::Function rho(std::make_shared<const df::FunctionSpace>(V));
@@ -116,7 +153,7 @@ int run(const Options &opt)
      **************************************************************************/
     cout << "Setup species" << endl;
     auto species = read_species(opt, mesh, eps0);
-    create_flux(species, mesh.exterior_facets);
+    create_flux(species, mesh.exterior_facets, setup_cache);
 
     /***************************************************************************
      * SETUP TIME-STEP
@@ -166,11 +203,15 @@ int run(const Options &opt)
         circuit = std::make_shared<CircuitBC>(V, objects, vsources, isources, dt, eps0);
 
     } else if (object_method == "CM") {
+        bool cache_capacitance = true;
+        opt.get("objects.cache_capacitance", cache_capacitance, true);
+
         for(size_t i=0; i<mesh.num_objects; i++){
             objects.push_back(std::make_shared<ObjectCM>(V, mesh, i+2));
             objects[i]->charge = object_charges[i];
         }
-        circuit = std::make_shared<CircuitCM>(V, objects, vsources, isources, mesh, dt, eps0);
+        circuit = std::make_shared<CircuitCM>(V, objects, vsources, isources, mesh, dt, eps0,
+                                              cache_capacitance ? fname_cap : "");
     } else {
         cerr << "objects.method must be CM or BC." << endl;
         return 1;
@@ -193,12 +234,29 @@ int run(const Options &opt)
     bool statistics_population = false;
     opt.get("diagnostics.statistics_population", statistics_population, true);
 
+    bool solver_statistics = false;
+    opt.get("diagnostics.solver_statistics", solver_statistics, true);
+
     bool save_state_on_exit = true;
     opt.get("diagnostics.save_state_on_exit", save_state_on_exit, true);
 
     bool save_fields_on_exit = true;
     opt.get("diagnostics.save_fields_on_exit", save_fields_on_exit, true);
 
+    auto &profiler = Profiler::instance();
+
+    bool profile = false;
+    opt.get("diagnostics.profile", profile, true);
+    if(profile) profiler.open_csv("profile.csv");
+
+    bool trace = false;
+    opt.get("diagnostics.trace", trace, true);
+    if(trace) profiler.enable_trace();
+
+    bool hardware_counters = false;
+    opt.get("diagnostics.hardware_counters", hardware_counters, true);
+    if(hardware_counters) profiler.enable_hardware_counters("particles");
+
     double period_n=0, period_rho=0, period_E=0, period_phi=0;
     opt.get("diagnostics.period_n"  , period_n  , true);
     opt.get("diagnostics.period_rho", period_rho, true);
@@ -229,26 +287,29 @@ int run(const Options &opt)
     ifile_hist.close();
     ifile_pop.close();
 
-    History hist(fname_hist, objects, dim, statistics_population, continue_simulation, hex_history);
+    History hist(fname_hist, objects, dim, statistics_population,
+                 continue_simulation, hex_history, solver_statistics);
     State state(fname_state);
 
-    df::File file_E      ("fields/E.pvd");
-    df::File file_phi    ("fields/phi.pvd");
-    df::File file_rho    ("fields/rho.pvd");
-    df::File file_ni     ("fields/ni.pvd");
-    df::File file_ne     ("fields/ne.pvd");
-    df::File file_E_ema  ("fields/E_ema.pvd");
-    df::File file_phi_ema("fields/phi_ema.pvd");
-    df::File file_rho_ema("fields/rho_ema.pvd");
-    df::File file_ni_ema ("fields/ni_ema.pvd");
-    df::File file_ne_ema ("fields/ne_ema.pvd");
+    // Fields are written in the background while the simulation continues
+    FieldWriter field_writer(mesh.mesh);
+    FieldFile file_E      (field_writer, "fields/E.pvd");
+    FieldFile file_phi    (field_writer, "fields/phi.pvd");
+    FieldFile file_rho    (field_writer, "fields/rho.pvd");
+    FieldFile file_ni     (field_writer, "fields/ni.pvd");
+    FieldFile file_ne     (field_writer, "fields/ne.pvd");
+    FieldFile file_E_ema  (field_writer, "fields/E_ema.pvd");
+    FieldFile file_phi_ema(field_writer, "fields/phi_ema.pvd");
+    FieldFile file_rho_ema(field_writer, "fields/rho_ema.pvd");
+    FieldFile file_ni_ema (field_writer, "fields/ni_ema.pvd");
+    FieldFile file_ne_ema (field_writer, "fields/ne_ema.pvd");
 
     /***************************************************************************
      * SETUP PARTICLES
      **************************************************************************/
     cout << "Setup particles" << endl;
 
-    Population<dim> pop(mesh);
+    Population<dim> pop(mesh, setup_cache);
 
     size_t n = 0;
     double t = 0;
@@ -256,6 +317,10 @@ int run(const Options &opt)
     bool prefill = true;
     opt.get("prefill", prefill, true);
 
+    // With MPI, the cores are already occupied by the ranks
+    size_t injector_threads = df::MPI::size(mesh.mesh->mpi_comm()) > 1 ? 1 : 0;
+    opt.get("injector.threads", injector_threads, true);
+
     if(continue_simulation){
         cout << "  Continuing previous simulation" << endl;
         state.load(n, t, objects);
@@ -264,7 +329,7 @@ int run(const Options &opt)
         cout << "  Starting new simulation" << endl;
         if(prefill){
             cout << "  Initializing particles" << endl;
-            load_particles(pop, species);
+            load_particles(pop, species, n);
         }
     }
 
@@ -282,17 +347,66 @@ int run(const Options &opt)
     double linalg_reltol = 1e-10;
     opt.get("poisson.abstol", linalg_abstol, true);
     opt.get("poisson.reltol", linalg_reltol, true);
-    
+
+    bool linalg_warm_start = false;
+    opt.get("poisson.warm_start", linalg_warm_start, true);
+
+    // Relative tolerance adapted to the noise level (reltol is a lower bound)
+    double linalg_adaptive_tol = 0;
+    opt.get("poisson.adaptive_tol", linalg_adaptive_tol, true);
+
     auto ext_bc = exterior_bc(V, mesh, species[0].vdf->vd(), B);
 
     PoissonSolver poisson(V, objects, ext_bc, circuit, eps0, false,
-                          linalg_method, linalg_preconditioner);
+                          linalg_method, linalg_preconditioner, setup_cache);
 
     poisson.set_abstol(linalg_abstol);
     poisson.set_reltol(linalg_reltol);
+    poisson.set_warm_start(linalg_warm_start);
+
+    // Deflate the solver using the Laplace solutions of the objects
+    bool linalg_deflation = false;
+    opt.get("poisson.deflation", linalg_deflation, true);
+
+    if(linalg_deflation){
+        vector<df::Function> laplace_solutions;
+        auto circuit_cm = std::dynamic_pointer_cast<CircuitCM>(circuit);
+        if(circuit_cm){
+            laplace_solutions = circuit_cm->get_laplace_solutions();
+        } else {
+            vector<std::shared_ptr<Object>> cm_objects;
+            for(size_t i=0; i<mesh.num_objects; i++){
+                cm_objects.push_back(std::make_shared<ObjectCM>(V, mesh, i+2));
+            }
+            laplace_solutions = laplace_solver(V, cm_objects, mesh, eps0);
+        }
+        poisson.set_deflation(laplace_solutions);
+    }
 
-    ESolver esolver(W);
-    // EFieldMean esolver(P, W);
+    if(linalg_method == "direct-cached"){
+        cout << "  LU factorization memory: ";
+        cout << poisson.factorization_memory()/(1024*1024) << " MB" << endl;
+    }
+
+    if(setup_cache) setup_cache->save();
+
+    string efield_method = "project";
+    opt.get("efield.method", efield_method, true);
+
+    std::shared_ptr<ESolver> esolver;
+    std::shared_ptr<EFieldMean> emean;
+    if (efield_method == "project") {
+        esolver = make_shared<ESolver>(W);
+    } else if (efield_method == "lumped") {
+        esolver = make_shared<ESolver>(W, "lumped");
+    } else if (efield_method == "arithmetic") {
+        emean = make_shared<EFieldMean>(P, W, true);
+    } else if (efield_method == "clement") {
+        emean = make_shared<EFieldMean>(P, W, false);
+    } else {
+        cerr << "efield.method must be project, lumped, arithmetic or clement." << endl;
+        return 1;
+    }
 
     /***************************************************************************
      * SETUP TIME LOOP CONTROL
@@ -354,13 +468,20 @@ int run(const Options &opt)
 
         // SOLVE POISSON EQUATION WITH OBJECTS
         timer.tic("poisson");
+        if(linalg_adaptive_tol > 0){
+            poisson.set_adaptive_reltol((double)num_tot/V.dim(),
+                                        linalg_adaptive_tol, linalg_reltol);
+        }
         poisson.solve_circuit(phi, rho, mesh, objects, circuit);
         timer.toc();
 
         // ELECTRIC FIELD
         timer.tic("efield");
-        esolver.solve(E, phi);
-        // esolver.mean(E, phi);
+        if (esolver) {
+            esolver->solve(E, phi);
+        } else {
+            emean->mean(E, phi);
+        }
         timer.toc();
 
         // POTENTIAL ENERGY
@@ -393,7 +514,7 @@ int run(const Options &opt)
         // WRITE HISTORY
         // Everything at n, except currents which are at n-0.5.
         timer.tic("io");
-        hist.save(n, t, num_e, num_i, KE, PE, objects, pop);
+        hist.save(n, t, num_e, num_i, KE, PE, objects, pop, poisson.stats);
         timer.toc();
 
         // MOVE PARTICLES
@@ -419,7 +540,10 @@ int run(const Options &opt)
 
         // INJECT PARTICLES
         timer.tic("injector");
-        inject_particles(pop, species, mesh.exterior_facets, dt);
+        double num_before = pop.num_of_particles();
+        inject_particles(pop, species, mesh.exterior_facets, dt, n,
+                         injector_threads);
+        profiler.count("injected particles", pop.num_of_particles() - num_before);
         timer.toc();
 
         // AVERAGE AND SAVE FIELDS (rho, phi, E)
@@ -451,7 +575,9 @@ int run(const Options &opt)
         bool save_n_now = time_is_now(period_n, t, dt) || save_fields_now;
 
         if(filter_n || save_n_now){
+            timer.tic("density");
             density_cg1(V, pop, species, ne, ni, dv_inv);
+            timer.toc();
         }
 
         if(filter_n){
@@ -476,11 +602,22 @@ int run(const Options &opt)
 
         timer.toc();
 
+        profiler.count("particles", num_tot);
+        profiler.count("krylov iterations", poisson.stats.iterations);
+        profiler.step(n);
+
         if(exit_now) break;
     }
 
     if(override_status_print) cout << endl;
+
+    // Wait for the remaining fields to be written
+    timer.tic("io");
+    field_writer.flush();
+    timer.toc();
+
     timer.summary();
+    if(trace) profiler.write_trace("trace.json");
     printf("Crossings per particle per timestep: %.5f\n", tot_mean_crossings/steps);
     cout << "PUNC++ finished successfully!" << endl;
     return 0;
@@ -507,6 +644,8 @@ int main(int argc, char **argv){
         ("mesh"   , value(), "Mesh file (.xml or .hdf5)")
         ("B"      , value(), "Magnetic field [T] (default: zero)")
         ("prefill", value(), "Whether to initialize new simulation by prefilling the domain uniformly with particles. Options: true (default), false")
+        ("seed", value(), "Seed of the random number generator. Default: drawn from std::random_device (printed on startup)")
+        ("cache_setup", value(), "Store the Poisson operator, localizer, vertex volumes and injection fluxes in setup.dat (and setup_operator.dat), and reuse them when restarting with the same mesh, species and objects (serial only). Options: true (default), false")
 
         ("time.stop"     , value(), "When to stop simulation. Suffixes:\n"
                                     "  s - seconds\n"
@@ -545,7 +684,9 @@ int main(int argc, char **argv){
                                          "  maxwellian   - Maxwellian (default)\n"
                                          "  kappa        - Kappa\n"
                                          "  cairns       - Cairns\n"
-                                         "  kappa-cairns - Kappa-Cairns")
+                                         "  kappa-cairns - Kappa-Cairns\n"
+                                         "  tabulated    - Tabulated on a grid (see species.vdf_file)")
+        ("species.vdf_file"     , value(), "File containing the tabulated velocity distribution (see TabulatedPdf) [m/s]. The temperature and drift of the species are then taken from the table")
 
         ("objects.method" , value(), "Object method. Options:\n"
                                    "  BC - Method described in PUNC++ paper\n"
@@ -553,6 +694,9 @@ int main(int argc, char **argv){
         ("objects.charge" , value(), "Initial object charge (one per object, in ascending order, default: zero) [C]")
         ("objects.vsource", value(), "Voltage source between objects a and b. Syntax: object_a object_b value [V]")
         ("objects.isource", value(), "Current source between objects a and b. Syntax: object_a object_b value [I]")
+        ("objects.cache_capacitance", value(), "Store capacitance matrix in capacitance.dat and reuse it for the same mesh (CM only). Options: true (default), false")
+
+        ("injector.threads", value(), "Number of threads injecting particles. Use 0 for all hardware threads. Default: 0 in serial, 1 with MPI")
 
         ("diagnostics.period_n"                , value(), "Save number densities with a given physical period [s]. Disable with 0 (default)")
         ("diagnostics.period_rho"              , value(), "Save charge density with a given physical period [s]. Disable with 0 (default)")
@@ -568,11 +712,24 @@ int main(int argc, char **argv){
         ("diagnostics.binary_population"       , value(), "Write population files in binary format. Options: true (default), false")
         ("diagnostics.hex_history"             , value(), "Write history file in hexadecimal format. Options: true, false (default)")
         ("diagnostics.statistics_population"   , value(), "Write population statistics to file. Options: true, false (default)")
-
-        ("poisson.method"        , value() , "Linear algebra solver. See FEniCS for options. Default depends on object method.")
+        ("diagnostics.solver_statistics"       , value(), "Write Poisson solver iterations, residual and solve time to history file. Options: true, false (default)")
+        ("diagnostics.profile"                 , value(), "Write time spent in each task and counters (particles, injected particles, Krylov iterations) every timestep to profile.csv. Options: true, false (default)")
+        ("diagnostics.trace"                   , value(), "Write timeline of all tasks (all threads) to trace.json, viewable in chrome://tracing or Perfetto. Options: true, false (default)")
+        ("diagnostics.hardware_counters"       , value(), "Measure cycles, instructions, cache and branch misses of each task with perf_event_open, and report IPC and memory traffic (per particle) in the summary. Ignored if unavailable. Options: true, false (default)")
+
+        ("efield.method"         , value() , "Method for computing the electric field in CG1. Options:\n"
+                                           "  project    - Projection of -grad(phi) (default)\n"
+                                           "  lumped     - Projection with lumped mass matrix (one matrix-vector product)\n"
+                                           "  arithmetic - Arithmetic mean of DG0 field\n"
+                                           "  clement    - Clement interpolation of DG0 field")
+
+        ("poisson.method"        , value() , "Linear algebra solver. See FEniCS for options, or use direct-cached to LU-factorize the system once. Default depends on object method.")
         ("poisson.preconditioner", value() , "Linear algebra preconditioner. See FEniCS for options. Default depends on object method.")
         ("poisson.abstol"        , value() , "Absolute residual tolerance. Default: 1e-14")
         ("poisson.reltol"        , value() , "Relative residual tolerance. Default: 1e-12")
+        ("poisson.warm_start"    , value() , "Use previous potential as initial guess. Options: true, false (default)")
+        ("poisson.deflation"     , value() , "Deflate the iterative solver using the Laplace solutions of the objects (compare iterations using diagnostics.solver_statistics). Options: true, false (default)")
+        ("poisson.adaptive_tol"  , value() , "Set relative tolerance this factor below the statistical noise in rho every step (bounded below by reltol, logged with diagnostics.solver_statistics). Disable with 0 (default). Suggested: 0.01")
     ;
 
     // Setting config file as positional argument
@@ -88,6 +88,9 @@ vector<Species> read_species(const Options &opt, const Mesh &mesh, double eps0){
     vector<vector<double>> vdrift(nSpecies, vector<double>(mesh.dim));
     opt.get_repeated_vector("species.vdrift", vdrift, mesh.dim, nSpecies, true);
 
+    vector<string> vdf_file(nSpecies, "");
+    opt.get_repeated("species.vdf_file", vdf_file, nSpecies, true);
+
     vector<Species> species;
 
     for(size_t s=0; s<nSpecies; s++){
@@ -103,10 +106,17 @@ vector<Species> read_species(const Options &opt, const Mesh &mesh, double eps0){
             vdf = std::make_shared<Cairns>(thermal[s], vdrift[s], alpha[s]);
         }else if (distribution[s] == "kappa-cairns"){
             vdf = std::make_shared<KappaCairns>(thermal[s], vdrift[s], kappa[s], alpha[s]);
+        }else if (distribution[s] == "tabulated"){
+            vdf = std::make_shared<TabulatedPdf>(vdf_file[s]);
+            if(vdf->dim != static_cast<int>(mesh.dim)){
+                cerr << "species.vdf_file " << vdf_file[s]
+                     << " must have the same dimension as the mesh" << endl;
+                exit(1);
+            }
         } else {
             cerr << "species.distribution must be one of: "
-                 << "\"maxwellian\", \"kappa\", \"cairns\", \"kappa-cairns\""
-                 << endl;
+                 << "\"maxwellian\", \"kappa\", \"cairns\", \"kappa-cairns\", "
+                 << "\"tabulated\"" << endl;
             exit(1);
         }
 
@@ -29,6 +29,7 @@
 #include <vector>
 #include <iostream>
 #include <boost/program_options.hpp>
+#include <boost/functional/hash.hpp>
 
 namespace po = boost::program_options;
 using std::cout;
@@ -262,6 +263,28 @@ public:
 
     }
 
+    /**
+     * @brief Hash of entries
+     * @param   prefixes    Prefixes of the keys to include (e.g. "species.")
+     * @return              Hash of the keys and values of all entries whose
+     *                      key starts with one of the prefixes
+     */
+    size_t hash(const vector<string> &prefixes) const {
+
+        size_t seed = 0;
+        for(auto &entry : vm){
+            for(auto &prefix : prefixes){
+                if(entry.first.compare(0, prefix.size(), prefix) == 0){
+                    boost::hash_combine(seed, entry.first);
+                    auto &bodies = entry.second.as<vector<string>>();
+                    boost::hash_range(seed, bodies.begin(), bodies.end());
+                    break;
+                }
+            }
+        }
+        return seed;
+    }
+
     /**
      * @brief Get repeated vector valued entries
      * @param       key         Key for which to get values and suffixes.
@@ -31,5 +31,9 @@
 #include "punc/pusher.h"
 #include "punc/distributions.h"
 #include "punc/mesh.h"
+#include "punc/setup_cache.h"
+#include "punc/random.h"
+#include "punc/profiler.h"
+#include "punc/field_writer.h"
 
 #endif
@@ -27,6 +27,7 @@
 #define DIAGNOSTICS_H
 
 #include "population.h"
+#include "profiler.h"
 
 #include <dolfin/io/File.h>
 #include <dolfin/fem/DofMap.h>
@@ -80,6 +81,7 @@ public:
     std::size_t dim;
     bool stats;
     bool hex_output;
+    bool solver_stats;
     std::ofstream ofile; ///< std::string - name of the history file
 
     /**
@@ -88,12 +90,14 @@ public:
      * @param   objects - a vector of objects
      * @param   dim  - geometrical dimension
      * @param   continue_simulation  boolean - if false creates a preamble for history file
+     * @param   solver_stats - whether to write Poisson solver statistics
      */
     History(const std::string &fname,
             ObjectVector objects, 
             std::size_t dim, bool stats,
             bool continue_simulation = false,
-            bool hex_output = false);
+            bool hex_output = false,
+            bool solver_stats = false);
 
     /**
      * @brief   History destructor - closes the file 
@@ -109,16 +113,20 @@ public:
      * @param   KE  - total kinetic energy
      * @param   PE  - total potential energy
      * @param   objects - a vector of objects
+     * @param   pop - the population
+     * @param   solver - statistics of the Poisson solver for this time-step
      */
     template <typename PopulationType>
     void save(std::size_t n, double t, double num_e, double num_i, double KE,
-              double PE, ObjectVector objects, PopulationType &pop);
+              double PE, ObjectVector objects, PopulationType &pop,
+              const SolverStatistics &solver = SolverStatistics());
 
 };
 
 template <typename PopulationType>
 void History::save(std::size_t n, double t, double num_e, double num_i, double KE,
-                   double PE, ObjectVector objects, PopulationType &pop)
+                   double PE, ObjectVector objects, PopulationType &pop,
+                   const SolverStatistics &solver)
 {
     /* This part only works with GCC 5.1.0 and above. 
        Currently we are using GCC 4.8.5.
@@ -162,11 +170,21 @@ void History::save(std::size_t n, double t, double num_e, double num_i, double K
         ofile << "\t" << statistics[2]; /* Mean speed for ions*/
         ofile << "\t" << statistics[3]; /* Standard deviation for ions*/
     }
+    if (solver_stats)
+    {
+        ofile << "\t" << (double)solver.iterations;
+        ofile << "\t" << solver.residual;
+        ofile << "\t" << solver.time;
+        ofile << "\t" << solver.tolerance;
+    }
     ofile << std::endl;
 }
 
 /**
  * @brief Measures time for a given set of tasks
+ *
+ * Tasks are timed as scopes of Profiler::instance(), and may therefore be
+ * nested, both within each other and within other profiled scopes.
  */
 class Timer
 {
@@ -198,7 +216,7 @@ class Timer
     void tic(std::string tag);
 
     /**
-       * Stops measuring time for the task started by tic()
+       * Stops measuring time for the task most recently started by tic()
        */
     void toc();
 
@@ -210,6 +228,8 @@ class Timer
 
     /**
        * Prints the total time elapsed by each task, and print to the screen.
+       * The tasks are listed in the order given to the constructor, followed
+       * by any other profiled scopes (see Profiler::summary()).
        */
     void summary();
 
@@ -222,15 +242,12 @@ class Timer
 
   private:
     std::vector<std::string> tasks;
-    std::vector<double> times;
 
     typedef std::chrono::high_resolution_clock _clock;
     typedef std::chrono::duration<double, std::ratio<1>> _second;
     typedef std::chrono::duration<int, std::ratio_multiply<std::chrono::hours::period, std::ratio<24>>::type> days;
 
     std::chrono::time_point<_clock> _begin;
-    std::chrono::time_point<_clock> _time;
-    int _index;
 };
 
 
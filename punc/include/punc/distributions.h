@@ -26,6 +26,12 @@
 #define DISTRIBUTIONS_H
 
 #include "mesh.h"
+#include "random.h"
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
 
 #include <boost/math/special_functions/erf.hpp>
 #include <boost/units/systems/si/codata/electromagnetic_constants.hpp>
@@ -46,6 +52,30 @@ namespace df = dolfin;
  */
 signed long int locate(std::shared_ptr<const df::Mesh> mesh, const double *x);
 
+/**
+ * @brief Inverse CDF of the standard normal distribution, in bulk
+ * @param[in, out] xs - array of uniformly distributed random numbers in (0,1),
+ *                      overwritten by standard normally distributed numbers
+ * @param[in]      n  - number of random numbers
+ *
+ * Uses the rational approximations of Wichura, "Algorithm AS241: The
+ * percentage points of the normal distribution", Applied Statistics 37
+ * (1988), which are accurate to about 1e-16. The central region, which
+ * covers 85% of the numbers, is evaluated without branches for all numbers
+ * such that the loop vectorizes, before the tails are corrected.
+ */
+void normal_icdf(double *xs, std::size_t n);
+
+/**
+ * @brief Key identifying a normal vector
+ * @param[in] n - normal vector
+ * @return    the components quantized to 1e-9
+ *
+ * Facets whose normals have the same key share flux tables (see
+ * create_flux() and Pdf::init_flux()).
+ */
+std::vector<long long> normal_key(const std::vector<double> &n);
+
 /**
  * @brief Generic class for probability distribution functions, PDF
  */
@@ -54,11 +84,30 @@ class Pdf
 protected:
     double _vth;             ///< Thermal velocity
     std::vector<double> _vd; ///< Drift velocity
+
+    /**
+     * @brief Whether the drift velocity is zero
+     */
+    bool drift_free() const
+    {
+        return std::all_of(_vd.begin(), _vd.end(),
+                           [](double v) { return v == 0.0; });
+    }
+
+    /**
+     * @brief Updates has_sampler and has_flux_sampler
+     *
+     * Called by set_vd(), for PDFs whose exact samplers depend on the drift
+     * velocity.
+     */
+    virtual void update_samplers() { }
 public:
     int dim;                    ///< Dimension of configuration or velocity space
     bool has_icdf;              ///< Whether or not analytical expression for the inverse of CDF exists
     bool has_flux_number;       ///< Whether or not analytical expression for the number of paraticles through a surface exists
     bool has_flux_max;          ///< Whether or not analytical expression for the maximum value of flux PDF exists
+    bool has_sampler = false;      ///< Whether or not an exact sampler for the PDF exists
+    bool has_flux_sampler = false; ///< Whether or not an exact sampler for the flux PDF exists
     double vdf_range;           ///< The range of PDF
     std::vector<double> domain; ///< Vector containing the range of either configuration or velocity space in each dimension
 
@@ -101,6 +150,46 @@ public:
         return (vn > 0.0) * vn * this->operator()(x);
     }
 
+    /**
+     * @brief The PDF evaluated at a batch of points
+     * @param[in]  xs   - array of N points in configuration or velocity space
+     * @param[in]  N    - number of points
+     * @param[out] out  - array of the N values of the PDF
+     *
+     * Samplers and integrators evaluate the PDF at blocks of points through
+     * this function, such that there is one virtual call per block rather
+     * than per point. Derived classes should override it with a tight loop.
+     */
+    virtual void evaluate(const double *xs, std::size_t N, double *out)
+    {
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            out[i] = this->operator()(&xs[i * dim]);
+        }
+    }
+
+    /**
+     * @brief The flux PDF evaluated at a batch of points
+     * @param[in]  xs   - array of N points in velocity space
+     * @param[in]  N    - number of points
+     * @param[in]  n    - the normal vector representing a facet
+     * @param[out] out  - array of the N values of the flux PDF
+     */
+    virtual void evaluate(const double *xs, std::size_t N,
+                          const std::vector<double> &n, double *out)
+    {
+        evaluate(xs, N, out);
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            double vn = 0.0;
+            for (int j = 0; j < dim; ++j)
+            {
+                vn += xs[i * dim + j] * n[j];
+            }
+            out[i] *= vn > 0.0 ? vn : 0.0;
+        }
+    }
+
     virtual double max() = 0;                        ///< Maximum value of the PDF
     virtual double vth() { return _vth; }            ///< Returns the thermal velocity
     virtual std::vector<double> vd() { return _vd; } ///< Returns the drift velocity
@@ -125,12 +214,14 @@ public:
      * @brief Sets a new drift velocity. Used for normalization.
      * @param[in]  v  - the (normalized) drift velocity
      * 
-     * Updates the PDF domain, after the new drift velocity has been set. 
+     * Updates the PDF domain and the available exact samplers, after the new
+     * drift velocity has been set.
      */
     virtual void set_vd(std::vector<double> &v)
     {
         _vd = v;
         update_domain();
+        update_samplers();
     }
 
     /**
@@ -153,6 +244,17 @@ public:
      */
     virtual void icdf(double *vs, std::size_t N) { }
 
+    /**
+     * @brief Exact sampler for the PDF
+     * @param[in]  N    - number of random velocities to be sampled
+     * @param[in]  rng  - random number stream
+     * @param[out] vs   - array of N velocities sampled from the PDF
+     *
+     * Only available if has_sampler is true. Otherwise the PDF must be
+     * sampled using icdf() or rejection_sampler().
+     */
+    virtual void sample(std::size_t N, RandomStream &rng, double *vs) { }
+
     /**
      * @brief Number of particles for a given facet with normal vector n and area S
      * @param[in]  n  - the normal vector representing a facet
@@ -168,6 +270,19 @@ public:
      */
     virtual double flux_max(std::vector<double> &n) { return 0.0; };
 
+    /**
+     * @brief Exact sampler for the flux PDF
+     * @param[in]  n    - the normal vector representing a facet
+     * @param[in]  N    - number of random velocities to be sampled
+     * @param[in]  rng  - random number stream
+     * @param[out] vs   - array of N velocities sampled from the flux PDF
+     *
+     * Only available if has_flux_sampler is true. Otherwise the flux PDF must
+     * be sampled using rejection_sampler().
+     */
+    virtual void sample_flux(const std::vector<double> &n, std::size_t N,
+                             RandomStream &rng, double *vs) { }
+
     /**
      * @brief The Debye length for the plasma species described by the VDF
      * @param[in]  m    - Species mass 
@@ -178,6 +293,16 @@ public:
      * @return     the Debye length
      */
     virtual double debye(double m, double q, double n, double eps0) { return 0.0; };
+
+    /**
+     * @brief Prepares for evaluating and sampling the flux PDF
+     * @param[in]  normals  - the distinct normal vectors of the exterior facets
+     *
+     * Called by create_flux() before injection, such that distributions may
+     * precompute per-normal quantities. Since sample_flux() may be called
+     * concurrently by several threads, it must not modify the object.
+     */
+    virtual void init_flux(const std::vector<std::vector<double>> &normals) { }
 };
 
 /**
@@ -217,6 +342,15 @@ public:
         return (locate(_mesh, x) >= 0) * 1.0;
     };
 
+    using Pdf::evaluate;
+    void evaluate(const double *xs, std::size_t N, double *out)
+    {
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            out[i] = (locate(_mesh, &xs[i * dim]) >= 0) * 1.0;
+        }
+    }
+
     double max() { return 1.0; }; ///< Returns the maximum value of the PDF
 };
 
@@ -241,11 +375,22 @@ public:
                 double vdf_range = 5.0);
 
     double operator()(const double *v);
+    using Pdf::evaluate;
+    void evaluate(const double *vs, std::size_t N, double *out);
     double max() { return factor; };
     void icdf(double *vs, std::size_t N);
     double flux_num_particles(const std::vector<double> &n, double S);
     double flux_max(std::vector<double> &n);
     double debye(double m, double q, double n, double eps0);
+
+    /**
+     * @brief Exact sampler for the flux PDF
+     *
+     * The tangential velocity components are Gaussian, whereas the normal
+     * component is sampled by numerically inverting its CDF.
+     */
+    void sample_flux(const std::vector<double> &n, std::size_t N,
+                     RandomStream &rng, double *vs);
 };
 
 /**
@@ -275,10 +420,34 @@ public:
           double vdf_range = 7.0);
 
     double operator()(const double *v);
+    using Pdf::evaluate;
+    void evaluate(const double *vs, std::size_t N, double *out);
     double max() { return factor; }
     double flux_num_particles(const std::vector<double> &n, double S);
     double flux_max(std::vector<double> &n);
     double debye(double m, double q, double n, double eps0);
+
+    /**
+     * @brief Exact sampler for the PDF
+     *
+     * The Kappa distribution is a multivariate Student-t distribution, i.e.,
+     * a Gaussian scale mixture where the inverse variance is chi-squared
+     * distributed with \f[2\kappa+2-D\f] degrees of freedom.
+     */
+    void sample(std::size_t N, RandomStream &rng, double *vs);
+
+    /**
+     * @brief Exact sampler for the flux PDF (without drift only)
+     *
+     * Weighting by the flux reduces the degrees of freedom of the inverse
+     * variance by one, and for each sampled variance the flux of a Maxwellian
+     * is sampled.
+     */
+    void sample_flux(const std::vector<double> &n, std::size_t N,
+                     RandomStream &rng, double *vs);
+
+protected:
+    void update_samplers();
 };
 
 /**
@@ -309,9 +478,33 @@ public:
             bool has_flux_max = false, double vdf_range = 7.0);
 
     double operator()(const double *v);
+    using Pdf::evaluate;
+    void evaluate(const double *vs, std::size_t N, double *out);
     double max();
     double flux_num_particles(const std::vector<double> &n, double S);
     double debye(double m, double q, double n, double eps0);
+
+    /**
+     * @brief Exact sampler for the PDF (non-negative alpha only)
+     *
+     * The Cairns distribution is a mixture of a Maxwellian, with weight
+     * \f[1/(1+D(D+2)\alpha)\f], and an isotropic distribution whose squared
+     * speed is chi-squared distributed with \f[D+4\f] degrees of freedom.
+     */
+    void sample(std::size_t N, RandomStream &rng, double *vs);
+
+    /**
+     * @brief Exact sampler for the flux PDF (without drift only)
+     *
+     * Weighting by the flux increases the degrees of freedom of the squared
+     * speed by one, and the directions are cosine-distributed about the
+     * normal. The weights of the two components change accordingly.
+     */
+    void sample_flux(const std::vector<double> &n, std::size_t N,
+                     RandomStream &rng, double *vs);
+
+protected:
+    void update_samplers();
 };
 
 /**
@@ -346,8 +539,111 @@ public:
                 bool has_flux_max = false, double vdf_range = 15.0);
                 
     double operator()(const double *v);
+    using Pdf::evaluate;
+    void evaluate(const double *vs, std::size_t N, double *out);
     double max();
     double debye(double m, double q, double n, double eps0);
+
+    /**
+     * @brief Exact sampler for the PDF (non-negative alpha only)
+     *
+     * Like the Cairns distribution, this is a mixture of two components,
+     * each of which is a Gaussian scale mixture like the Kappa distribution.
+     * For the second component the degrees of freedom of the inverse
+     * variance are reduced by four.
+     */
+    void sample(std::size_t N, RandomStream &rng, double *vs);
+
+    /**
+     * @brief Exact sampler for the flux PDF (without drift only)
+     *
+     * As for the Kappa and Cairns distributions. Requires
+     * \f[\kappa>(D+3)/2\f] for non-zero alpha.
+     */
+    void sample_flux(const std::vector<double> &n, std::size_t N,
+                     RandomStream &rng, double *vs);
+
+protected:
+    void update_samplers();
+};
+
+/**
+ * @brief Velocity distribution function tabulated on a regular grid
+ *
+ * The table is read from a text file of the format
+ * @code
+ *  D
+ *  n_1 min_1 max_1
+ *  ...
+ *  n_D min_D max_D
+ *  f_1 f_2 ... f_{n_1 n_2 ... n_D}
+ * @endcode
+ * where D is the dimension, and n_i bins of equal width cover [min_i, max_i]
+ * along velocity component i. The values f are the (unnormalized) PDF in each
+ * bin, with the last component varying fastest. Lines starting with # are
+ * ignored. The PDF is piecewise constant, and zero outside the grid.
+ *
+ * Velocities are sampled exactly by choosing a bin by Walker's alias method
+ * and a uniformly distributed point within it. For the flux, a table of the
+ * bins is computed for each normal in init_flux(). A bin is chosen with
+ * probability proportional to the bin's PDF times its maximum normal velocity
+ * vn_max, and a point within it is accepted with probability vn/vn_max. The
+ * flux through bins which are intersected by the plane normal to n is
+ * integrated by the midpoint rule on a subgrid.
+ *
+ * The drift and thermal velocities are taken from the moments of the table.
+ */
+class TabulatedPdf : public Pdf
+{
+private:
+    std::vector<std::size_t> bins;      ///< Number of bins in each dimension
+    std::vector<double> lower, width;   ///< Lower bound and bin width in each dimension
+    std::vector<double> values;         ///< Normalized PDF in each bin
+    double value_max;                   ///< Maximum value of the PDF
+    AliasTable alias;                   ///< Bins weighted by probability
+
+    //! Flux through each bin for a given normal
+    struct FluxTable
+    {
+        std::vector<std::size_t> bins;  ///< Bins with a positive flux
+        std::vector<double> vn_max;     ///< Maximum normal velocity in each bin
+        AliasTable alias;               ///< Bins weighted by the upper bound of their flux
+        double flux;                    ///< Flux per unit area
+        double max;                     ///< Maximum value of the flux PDF
+    };
+    std::map<std::vector<long long>, FluxTable> flux_tables;
+
+    //! The bin containing v, or -1 if outside the grid
+    long bin(const double *v) const;
+
+    //! Computes the flux table of normal n
+    FluxTable build_flux_table(const std::vector<double> &n) const;
+
+    //! The flux table of normal n, which must be built by init_flux()
+    const FluxTable &flux_table(const std::vector<double> &n) const;
+
+    //! Uniformly distributed point v in bin b
+    void bin_point(std::size_t b, const double *u, double *v) const;
+
+public:
+    /**
+     * @brief Constructor
+     * @param[in]  fname  - file containing the table
+     */
+    TabulatedPdf(const std::string &fname);
+
+    double operator()(const double *v);
+    using Pdf::evaluate;
+    void evaluate(const double *vs, std::size_t N, double *out);
+    double max() { return value_max; }
+    double flux_num_particles(const std::vector<double> &n, double S);
+    double flux_max(std::vector<double> &n);
+    double debye(double m, double q, double n, double eps0);
+    void update_domain();
+    void init_flux(const std::vector<std::vector<double>> &normals);
+    void sample(std::size_t N, RandomStream &rng, double *vs);
+    void sample_flux(const std::vector<double> &n, std::size_t N,
+                     RandomStream &rng, double *vs);
 };
 
 } // namespace punc
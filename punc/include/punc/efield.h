@@ -38,20 +38,37 @@ namespace df = dolfin;
 
 /**
  * @brief Solver for the electric field (in CG1)
+ *
+ * Projects -grad(phi) onto CG1, i.e., solves M*E = G*phi, where M is the
+ * mass matrix and G the (constant) matrix mapping the potential to the
+ * load vector. G is assembled once, upon the first solve, such that each
+ * solve only requires a matrix-vector product to obtain the load vector.
+ *
+ * If method is "lumped" the mass matrix is replaced by its lumped (diagonal)
+ * approximation, and the operator D = M_lumped^{-1}*G is precomputed. Each
+ * solve is then a single sparse matrix-vector product E = D*phi. To instead
+ * factorize M exactly once use method "preonly" and preconditioner "lu".
  */
 class ESolver
 {
 private:
-    df::PETScKrylovSolver solver;         /// < Linear algebra solver
-    std::shared_ptr<df::Form> a, L;       /// < Bilinear and linear forms
-    df::PETScMatrix A;                    /// < Stiffness matrix
+    std::shared_ptr<df::PETScKrylovSolver> solver; /// < Linear algebra solver
+    std::shared_ptr<df::Form> a;          /// < Bilinear form (mass matrix)
+    df::PETScMatrix A;                    /// < Mass matrix
+    df::PETScMatrix G;                    /// < Gradient matrix (or D if lumped)
     df::PETScVector b;                    /// < Load vector
+    std::shared_ptr<const df::FunctionSpace> W; /// < Function space of E
+    std::shared_ptr<const df::FunctionSpace> V; /// < Function space of phi
+    bool lumped;                          /// < Whether to lump the mass matrix
+
+    //! Assembles G (and D) for potentials in V_phi. Used by solve().
+    void init_operator(std::shared_ptr<const df::FunctionSpace> V_phi);
 
 public:
      /**
      * @brief Constructor 
      * @param W                 The vector function space of the electric field
-     * @param method            Method of linear algebra solver
+     * @param method            Method of linear algebra solver, or "lumped"
      * @param preconditioner    Preconditioner for matrix equation
      */
     ESolver(const df::FunctionSpace &W,
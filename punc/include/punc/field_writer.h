@@ -0,0 +1,174 @@
+// Copyright (C) 2018, Diako Darian and Sigvald Marholm
+//
+// This file is part of PUNC++.
+//
+// PUNC++ is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// PUNC++ is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// PUNC++. If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ * @file		field_writer.h
+ * @brief		Asynchronous output of fields
+ */
+
+#ifndef FIELD_WRITER_H
+#define FIELD_WRITER_H
+
+#include <dolfin/function/Function.h>
+#include <dolfin/io/File.h>
+#include <dolfin/mesh/Mesh.h>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace punc
+{
+
+namespace df = dolfin;
+
+class FieldFile;
+
+/**
+ * @brief Writes snapshots of fields to file in a background thread
+ *
+ * Writing fields by df::File stalls the time-step while the VTK files are
+ * encoded and written. Instead, FieldFile::write() copies the vertex values
+ * of a field into a snapshot buffer, which is queued and written to file by
+ * a background thread while the simulation continues.
+ *
+ * Each FieldFile has a given number of buffers (two by default, i.e., double
+ * buffering), which bounds the memory used. If all buffers are in use,
+ * FieldFile::write() waits for the background thread to free one
+ * (backpressure). The snapshots are written in the order they were taken.
+ * flush() waits until all snapshots are written, and is also called upon
+ * destruction.
+ *
+ * The files are written in the same format as df::File, i.e., one .vtu file
+ * per snapshot and a .pvd file collecting them. The mesh is encoded only
+ * once. Since the background thread only touches the snapshot buffers, it
+ * does not call into DOLFIN or PETSc concurrently with the simulation.
+ *
+ * Writing is only asynchronous in serial. In parallel, FieldFile falls back
+ * to writing synchronously by df::File.
+ *
+ * @code
+ *  FieldWriter writer(mesh.mesh);
+ *  FieldFile file_phi(writer, "fields/phi.pvd");
+ *  for(...){
+ *      ...
+ *      file_phi.write(phi, t);
+ *  }
+ *  writer.flush();
+ * @endcode
+ */
+class FieldWriter
+{
+public:
+    /**
+     * @brief Constructor
+     * @param   mesh                The mesh of the fields
+     * @param   buffers_per_file    Maximum number of pending snapshots per file
+     */
+    FieldWriter(std::shared_ptr<const df::Mesh> mesh,
+                std::size_t buffers_per_file = 2);
+
+    /**
+     * @brief Destructor. Writes all pending snapshots.
+     */
+    ~FieldWriter();
+
+    FieldWriter(const FieldWriter &) = delete;
+    FieldWriter &operator=(const FieldWriter &) = delete;
+
+    /**
+     * @brief Waits until all snapshots are written to file
+     */
+    void flush();
+
+    /**
+     * @brief Whether writing is asynchronous (serial runs only)
+     */
+    bool enabled() const { return active; }
+
+private:
+    friend class FieldFile;
+
+    //! A field at one time
+    struct Snapshot
+    {
+        std::string fname;              ///< .pvd file
+        std::string name;               ///< Name of the field
+        double t;
+        std::size_t num_components;     ///< 1 for scalars, 3 for vectors
+        std::vector<double> values;     ///< Interleaved vertex values
+    };
+
+    std::shared_ptr<const df::Mesh> mesh;
+    bool active;
+
+    std::string geometry;               ///< Encoded vertices and cells
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::unique_ptr<Snapshot>> queue;
+    std::vector<std::unique_ptr<Snapshot>> pool;     ///< Free buffers
+    std::size_t capacity = 0;           ///< Maximum number of pending snapshots
+    std::size_t pending = 0;            ///< Queued or being written
+    std::size_t buffers_per_file;
+    bool stop = false;
+
+    //! Written snapshots of each .pvd file (only used by the thread)
+    std::map<std::string, std::vector<std::pair<double, std::string>>> collections;
+
+    std::thread thread;
+
+    std::unique_ptr<Snapshot> acquire();
+    void submit(std::unique_ptr<Snapshot> snapshot);
+    void run();
+    void write(const Snapshot &snapshot);
+};
+
+/**
+ * @brief A time series of a field, written by a FieldWriter
+ */
+class FieldFile
+{
+public:
+    /**
+     * @brief Constructor
+     * @param   writer  The writer
+     * @param   fname   File name (.pvd)
+     */
+    FieldFile(FieldWriter &writer, const std::string &fname);
+
+    /**
+     * @brief Takes a snapshot of a field to be written to file
+     * @param   f   The field (in CG1)
+     * @param   t   Time
+     */
+    void write(const df::Function &f, double t);
+
+private:
+    FieldWriter &writer;
+    std::string fname;
+    std::unique_ptr<df::File> file;     ///< Synchronous fallback
+    std::vector<double> vertex_values;
+};
+
+} // namespace punc
+
+#endif // FIELD_WRITER_H
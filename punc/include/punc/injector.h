@@ -26,44 +26,17 @@
 #define INJECTOR_H
 
 #include "population.h"
+#include "profiler.h"
 #include <random>
+#include <algorithm>
+#include <numeric>
+#include <thread>
 
 namespace punc
 {
 
 namespace df = dolfin;
 
-/**
- * @brief Generates random numbers to seed std::mt19937_64, i.e., the Mersenne 
- * Twister pseudo-random generator of 64-bit numbers
- */
-class RandomSeed
-{
-public:
-    /**
-     * @brief generates a sequence of random numbers using std::random_device
-     */
-    template <typename T>
-    void generate(T begin, T end)
-    {
-        for (; begin != end; ++begin)
-        {
-            *begin = device();
-        }
-    }
-    /**
-     * @brief Used to initialize std::mt19937_64
-     */
-    static RandomSeed &get_instance()
-    {
-        static thread_local RandomSeed seed;
-        return seed;
-    }
-
-private:
-    std::random_device device; ///< The random device to seed std::mt19937_64
-};
-
 /**
  * @brief Standard rejection sampler
  * @param vs[in, out] - array of generated random samples
@@ -72,20 +45,20 @@ private:
  * @param pdf_max[in] - maximum value of pdf
  * @param dim[in] - the dimension of the space pdf is defined on
  * @param domain[in] - the domian in which the random numbers are constrained to
- * @param rand[in] - the uniform distribution function
- * @param rng[in] - The Mersenne Twister pseudo-random generator of 64-bit numbers
+ * @param rng[in] - random number stream
  * 
  * Standard rejection sampler uses a simpler proposal distribution, which in 
  * this case is a uniform distribution function, U, to generate random samples. 
  * A sample is then accepted with probability pdf(v)/ U(v), or discarded 
  * otherwise. This process is repeated until a sample is accepted.
+ *
+ * The candidates are drawn and evaluated in blocks, using Pdf::evaluate().
  */
 void rejection_sampler(double *vs, std::size_t N,
                        std::shared_ptr<Pdf> pdf,
                        double pdf_max, int dim,
                        const std::vector<double> &domain,
-                       std::uniform_real_distribution<double> &rand,
-                       std::mt19937_64 &rng);
+                       RandomStream &rng);
 
 /**
  * @brief Standard rejection sampler
@@ -96,8 +69,7 @@ void rejection_sampler(double *vs, std::size_t N,
  * @param pdf_max[in] - maximum value of pdf
  * @param dim[in] - the dimension of the space pdf is defined on
  * @param domain[in] - the domian in which the random numbers are constrained to
- * @param rand[in] - the uniform distribution function
- * @param rng[in] - The Mersenne Twister pseudo-random generator of 64-bit numbers
+ * @param rng[in] - random number stream
  * 
  * Standard rejection sampler uses a simpler proposal distribution, which in 
  * this case is a uniform distribution function, U, to generate random samples. 
@@ -109,8 +81,7 @@ void rejection_sampler(double *vs, std::size_t N,
                        std::shared_ptr<Pdf> pdf,
                        double pdf_max, int dim,
                        const std::vector<double> &domain,
-                       std::uniform_real_distribution<double> &rand,
-                       std::mt19937_64 &rng);
+                       RandomStream &rng);
 
 /**
  * @brief Generates uniformly distributed random particle positions on a given exterior facet
@@ -118,7 +89,7 @@ void rejection_sampler(double *vs, std::size_t N,
  * @param N[in] - number of random particle positions to be generated
  * @param vertices[in] - a vector containing all the vertices of the facet
  * @param rand[in] - the uniform distribution function
- * @param rng[in] - The Mersenne Twister pseudo-random generator of 64-bit numbers
+ * @param rng[in] - random number stream
  * 
  * In 1D, a facet is a single point. Hence, there is no point in generating 
  * uniformly distributed random particle positions on a point. Therefore, this 
@@ -129,19 +100,84 @@ void rejection_sampler(double *vs, std::size_t N,
 void random_facet_points(double *xs, std::size_t N,
                             const std::vector<double> &vertices,
                             std::uniform_real_distribution<double> &rand,
-                            std::mt19937_64 &rng);
+                            RandomStream &rng);
+
+/**
+ * @brief Generates uniformly distributed random particle positions in the cells
+ * @param pop[in] - the plasma particle population
+ * @param cells[in] - alias table of the cells weighted by their volume
+ * @param N[in] - number of random particle positions to be generated
+ * @param rng[in] - random number stream
+ * @param xs[out] - the generated particle positions
+ * @param cell_ids[out] - the cells containing the particles
+ *
+ * A cell is chosen with probability proportional to its volume, and a point is
+ * drawn uniformly within the simplex by means of barycentric coordinates made
+ * from D+1 normalized exponentially distributed numbers. Since the cell is
+ * known, the particles need not be located.
+ */
+template <typename PopulationType>
+void random_cell_points(PopulationType &pop, const AliasTable &cells,
+                        std::size_t N, RandomStream &rng,
+                        std::vector<double> &xs,
+                        std::vector<signed long int> &cell_ids)
+{
+    auto dim = pop.g_dim;
+    xs.resize(N * dim);
+    cell_ids.resize(N);
+
+    std::vector<double> us(N * (dim + 2));
+    rng.uniform(us.data(), us.size());
+
+    double weights[dim + 1];
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        auto u = &us[i * (dim + 2)];
+        auto cell_id = cells(u[0]);
+        auto &vertices = pop.cells[cell_id].vertex_coordinates;
+
+        double sum = 0.0;
+        for (std::size_t j = 0; j < dim + 1; ++j)
+        {
+            weights[j] = -log(u[j + 1]);
+            sum += weights[j];
+        }
+
+        auto x = &xs[i * dim];
+        for (std::size_t k = 0; k < dim; ++k)
+        {
+            x[k] = 0.0;
+            for (std::size_t j = 0; j < dim + 1; ++j)
+            {
+                x[k] += weights[j] * vertices[j * dim + k];
+            }
+            x[k] /= sum;
+        }
+        cell_ids[i] = cell_id;
+    }
+}
 
 /**
  * @brief Creates flux needed for injecting particles through exterior boundary facets
  * @param  species[in] - A vector containing all the plasma species
  * @param  facets[in] - A vector containing all the exterior facets
+ * @param  cache[in] - Setup cache (optional)
  * 
  * For each species and for each exterior boundary facet, calculates the number 
  * of particles to be injected through the facet. In addition, for each facet
- * finds the maximum value of the flux probability distribution function by 
- * using Monte Carlo integration. This value is needed in the rejection sampler.
+ * finds the maximum value of the flux probability distribution function. This
+ * value is needed in the rejection sampler.
+ *
+ * Where no analytical expressions exist, the flux and the maximum are found
+ * by quasi-Monte Carlo integration using all hardware threads. This is done
+ * once for each distinct normal vector, and the flux is scaled by the facet
+ * area.
+ *
+ * The tables are loaded from the cache if present, and otherwise stored in it.
+ * Either way, Pdf::init_flux() is called with the distinct normals first.
  */
-void create_flux(std::vector<Species> &species, std::vector<ExteriorFacet> &facets);
+void create_flux(std::vector<Species> &species, std::vector<ExteriorFacet> &facets,
+                 std::shared_ptr<SetupCache> cache = nullptr);
 
 /**
  * @brief Injects particles through the exterior boundary facets
@@ -149,85 +185,161 @@ void create_flux(std::vector<Species> &species, std::vector<ExteriorFacet> &face
  * @param species[in] - a vector containing all the plasma species
  * @param facets[in] - a vector containing all the exterior facets
  * @param dt[in] - duration of a time-step 
+ * @param step[in] - the time-step (identifies the random streams)
+ * @param num_threads[in] - number of threads (0 for all hardware threads)
  * 
  * Generates random particle velocities and positions for each species from each
  * exterior boundary facet, and adds the newly created particles to plasma 
  * population. 
+ *
+ * Velocities are drawn by Pdf::sample_flux() where an exact sampler exists,
+ * and otherwise by rejection sampling of the flux PDF.
+ *
+ * The particles are located by Population::relocate() starting from the cell
+ * adjacent to their facet, such that no global search is needed.
+ *
+ * The random numbers for each species and facet are drawn from a separate
+ * RandomStream, making the injection reproducible for a given seed.
+ *
+ * The facets of all species are divided into contiguous ranges of roughly
+ * equal expected number of particles, one for each thread. Each thread
+ * samples and locates its particles into buffers of its own, which are
+ * appended to the population in facet order afterwards. The result is
+ * therefore independent of the number of threads.
  */
 template <typename PopulationType>
 void inject_particles(PopulationType &pop, std::vector<Species> &species,
-                      std::vector<ExteriorFacet> &facets, double dt)
+                      std::vector<ExteriorFacet> &facets, double dt,
+                      std::size_t step, std::size_t num_threads = 0)
 {
-    std::mt19937_64 rng{RandomSeed::get_instance()};
-    std::uniform_real_distribution<double> rand(0.0, 1.0);
-
     auto dim = pop.g_dim;
     auto num_species = species.size();
     auto num_facets = facets.size();
+    auto num_tasks = num_species * num_facets;
 
+    if (num_threads == 0)
+    {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    num_threads = std::max<std::size_t>(1, std::min(num_threads, num_tasks));
+
+    // Expected number of particles for each (species, facet), species major
+    std::vector<double> num(num_tasks);
     for (std::size_t i = 0; i < num_species; ++i)
     {
-        auto num = species[i].vdf->num_particles;
+        for (std::size_t j = 0; j < num_facets; ++j)
+        {
+            num[i * num_facets + j] = species[i].vdf->num_particles[j] * species[i].n * dt;
+        }
+    }
 
-        for (auto &num_i : num)
+    // Split the tasks into ranges of roughly equal work
+    std::vector<std::size_t> bounds(num_threads + 1, num_tasks);
+    bounds[0] = 0;
+    double total = std::accumulate(num.begin(), num.end(), 0.0);
+    double cumsum = 0.0;
+    std::size_t t = 1;
+    for (std::size_t k = 0; k < num_tasks && t < num_threads; ++k)
+    {
+        cumsum += num[k];
+        while (t < num_threads && cumsum >= total * t / num_threads)
         {
-            num_i *= species[i].n * dt;
+            bounds[t++] = k + 1;
         }
-        std::vector<std::size_t> num_particles(num.begin(), num.end());
-        std::size_t tot_num = std::accumulate(num_particles.begin(), num_particles.end(), 0);
-        tot_num += num.size();
-        std::vector<double> xs(tot_num * dim), vs(tot_num * dim);
-        double *xs_ptr = xs.data();
-        double *vs_ptr = vs.data();
-        std::size_t tot_N = 0;
-        for (std::size_t j = 0; j < num_facets; ++j)
+    }
+
+    // Output buffers of each thread and species
+    struct Buffer
+    {
+        std::vector<double> xs, vs;
+        std::vector<signed long int> cell_ids;
+    };
+    std::vector<std::vector<Buffer>> buffers(num_threads,
+                                             std::vector<Buffer>(num_species));
+
+    auto work = [&](std::size_t thread) {
+        ProfilerScope scope("inject thread");
+        std::uniform_real_distribution<double> rand(0.0, 1.0);
+        std::vector<double> xs_facet, vs_facet;
+
+        for (std::size_t k = bounds[thread]; k < bounds[thread + 1]; ++k)
         {
-            auto normal_i = facets[j].normal;
-            auto N_float = num[j];
-            auto N = static_cast<std::size_t>(N_float);
-            if (rand(rng) < (N_float - N))
+            auto i = k / num_facets;
+            auto j = k % num_facets;
+            auto &vdf = species[i].vdf;
+            auto &buffer = buffers[thread][i];
+
+            // Each facet has its own random stream
+            RandomStream rng(RandomStreamType::inject, step, i, j);
+
+            auto N = static_cast<std::size_t>(num[k]);
+            if (rand(rng) < (num[k] - N))
             {
                 N += 1;
             }
 
-            auto pdf_max = species[i].vdf->pdf_max[j];
-
-            random_facet_points(xs_ptr, N, facets[j].vertices, rand, rng);
-            rejection_sampler(vs_ptr, N, normal_i, species[i].vdf, pdf_max, species[i].vdf->dim,
-                              species[i].vdf->domain, rand, rng);
+            xs_facet.resize(N * dim);
+            vs_facet.resize(N * dim);
 
-            if (j < num_facets - 1)
+            random_facet_points(xs_facet.data(), N, facets[j].vertices, rand, rng);
+            if (vdf->has_flux_sampler)
             {
-                vs_ptr += N * dim;
-                xs_ptr += N * dim;
+                vdf->sample_flux(facets[j].normal, N, rng, vs_facet.data());
             }
-            tot_N += N;
-        }
-        xs_ptr = &xs[0];
-        vs_ptr = &vs[0];
-
-        std::size_t num_inside = 0;
-        for (std::size_t k = 0; k < tot_N; ++k)
-        {
-            auto r = rand(rng);
-            for (std::size_t l = 0; l < dim; ++l)
+            else
             {
-                xs_ptr[l] = xs[k * dim + l] + r * dt * vs[k * dim + l];
-                vs_ptr[l] = vs[k * dim + l];
+                rejection_sampler(vs_facet.data(), N, facets[j].normal, vdf, vdf->pdf_max[j],
+                                  vdf->dim, vdf->domain, rng);
             }
-            if (pop.locate(&xs[num_inside * dim]) >= 0)
+
+            // Particles start on the facet at a random time during the
+            // time-step, and are located by walking from its adjacent cell
+            for (std::size_t n = 0; n < N; ++n)
             {
-                if (k < tot_N - 1)
+                auto r = rand(rng);
+                auto x = &xs_facet[n * dim];
+                auto v = &vs_facet[n * dim];
+                for (std::size_t l = 0; l < dim; ++l)
                 {
-                    xs_ptr += dim;
-                    vs_ptr += dim;
+                    x[l] += r * dt * v[l];
+                }
+                auto cell_id = pop.relocate(x, facets[j].cell);
+                if (cell_id >= 0)
+                {
+                    buffer.xs.insert(buffer.xs.end(), x, x + dim);
+                    buffer.vs.insert(buffer.vs.end(), v, v + dim);
+                    buffer.cell_ids.push_back(cell_id);
                 }
-                num_inside++;
             }
         }
-        xs.resize(num_inside * dim);
-        vs.resize(num_inside * dim);
-        pop.add_particles(xs, vs, species[i].q, species[i].m);
+    };
+
+    if (num_threads == 1)
+    {
+        work(0);
+    }
+    else
+    {
+        std::vector<std::thread> threads;
+        for (std::size_t thread = 0; thread < num_threads; ++thread)
+        {
+            threads.emplace_back(work, thread);
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    // The particles are already located, and are merged directly into cells
+    for (std::size_t i = 0; i < num_species; ++i)
+    {
+        for (std::size_t thread = 0; thread < num_threads; ++thread)
+        {
+            auto &buffer = buffers[thread][i];
+            pop.add_particles(buffer.xs, buffer.vs, buffer.cell_ids,
+                              species[i].q, species[i].m);
+        }
     }
 }
 
@@ -235,45 +347,78 @@ void inject_particles(PopulationType &pop, std::vector<Species> &species,
  * @brief Generates particle velocities and positions for each species, and populates the simultion domain
  * @param pop[in, out] - the plasma particle population
  * @param species[in] - a vector containing all the plasma species
+ * @param step[in] - the time-step (identifies the random streams)
  * 
  * Generates random particle velocities based on the prespecified velocity
  * distribution function for each species, and populates the simulation domain
  * by generating uniformly distributed random positions in the entire domain.
  * The newly created particles are then added to the plasma population.
+ *
+ * Uniformly distributed positions (UniformPosition) are drawn directly within
+ * cells chosen by volume (see random_cell_points()), and need not be located.
+ * Other position distributions are rejection sampled in the bounding box.
+ *
+ * Velocities are drawn by the inverse CDF or an exact sampler when available,
+ * and by rejection sampling otherwise.
  */
 template <typename PopulationType>
-void load_particles(PopulationType &pop, std::vector<Species> &species)
+void load_particles(PopulationType &pop, std::vector<Species> &species,
+                    std::size_t step = 0)
 {
-    std::mt19937_64 rng{RandomSeed::get_instance()};
-    std::uniform_real_distribution<double> rand(0.0, 1.0);
+    // Cells weighted by volume, for uniformly distributed positions
+    AliasTable cells;
 
     auto num_species = species.size();
-    std::vector<double> xs, vs;
     for (std::size_t i = 0; i < num_species; ++i)
     {
         auto s = species[i];
         auto dim = s.vdf->dim;
         auto N = s.num;
         std::vector<double> xs(N * dim, 0.0), vs(N * dim, 0.0);
+        std::vector<signed long int> cell_ids;
+        RandomStream rng(RandomStreamType::load, step, i, 0);
 
-        rejection_sampler(xs.data(), N, s.pdf, s.pdf->max(), dim, s.pdf->domain, rand, rng);
-        if (s.vdf->has_icdf)
+        bool uniform = std::dynamic_pointer_cast<UniformPosition>(s.pdf) != nullptr;
+        if (uniform)
         {
-            for (auto j = 0; j < dim; ++j)
+            if (cells.size() == 0)
             {
-                for (auto k = 0; k < s.num; ++k)
+                std::vector<double> volumes(pop.num_cells);
+                for (std::size_t c = 0; c < pop.num_cells; ++c)
                 {
-                    vs[k * dim + j] = rand(rng);
+                    volumes[c] = pop.cells[c].volume();
                 }
+                cells = AliasTable(volumes);
             }
+            random_cell_points(pop, cells, N, rng, xs, cell_ids);
+        }
+        else
+        {
+            rejection_sampler(xs.data(), N, s.pdf, s.pdf->max(), dim, s.pdf->domain, rng);
+        }
+
+        if (s.vdf->has_icdf)
+        {
+            rng.uniform(vs.data(), N * dim);
             s.vdf->icdf(vs.data(), N);
         }
+        else if (s.vdf->has_sampler)
+        {
+            s.vdf->sample(N, rng, vs.data());
+        }
         else
         {
-            rejection_sampler(vs.data(), N, s.vdf, s.vdf->max(), dim, s.vdf->domain, rand, rng);
+            rejection_sampler(vs.data(), N, s.vdf, s.vdf->max(), dim, s.vdf->domain, rng);
         }
 
-        pop.add_particles(xs, vs, s.q, s.m);
+        if (uniform)
+        {
+            pop.add_particles(xs, vs, cell_ids, s.q, s.m);
+        }
+        else
+        {
+            pop.add_particles(xs, vs, s.q, s.m);
+        }
     }
 }
 
@@ -41,6 +41,7 @@ struct ExteriorFacet
     std::vector<double> vertices; ///< Vertices of the facet
     std::vector<double> normal;   ///< Normal vector of the facet
     std::vector<double> basis;    ///< Basis matrix for transforming from physical space to a space defined by the normal vector of the facet
+    std::size_t cell;             ///< Index of the cell adjacent to the facet
 };
 
 /**
@@ -85,6 +86,14 @@ public:
     //! The volume of the domain.
     double volume() const;
 
+    /**
+     * @brief Hash of the mesh geometry, topology and boundary markers
+     *
+     * Used to identify quantities cached on disk which are only valid for a
+     * given mesh.
+     */
+    size_t hash() const;
+
 private:
     //! Load file into Mesh. Used by Mesh().
     void load_file(string fname);
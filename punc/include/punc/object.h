@@ -28,9 +28,12 @@
 #include "mesh.h"
 
 #include <dolfin/function/Function.h>
+#include <dolfin/function/FunctionSpace.h>
 #include <dolfin/la/GenericVector.h>
 #include <dolfin/la/GenericMatrix.h>
 #include <dolfin/la/PETScMatrix.h>
+#include <dolfin/common/types.h>
+#include <dolfin/common/MPI.h>
 
 namespace punc {
 
@@ -99,6 +102,19 @@ public:
      */
     virtual void apply(df::GenericMatrix &A){};
 
+    /**
+     * @brief Describe apply(b) as entries to overwrite in the vector
+     * @param[out]  dofs        Local dofs overwritten by apply(b)
+     * @param[out]  potential   Whether the dofs are set to the object
+     *                          potential (otherwise they are set to zero)
+     * @return                  Whether apply(b) can be described this way
+     *
+     * Allows the solver to apply the boundary conditions of all objects
+     * through precomputed index sets instead of calling apply(b).
+     */
+    virtual bool vector_dofs(std::vector<df::la_index> &dofs,
+                             bool &potential) const { return false; };
+
     /**
      * @brief Set object potential
      * @param   p   new potential
@@ -202,11 +218,24 @@ public:
      * This method is run after solving the Poisson equation to update and
      * perform corrections to the objects. Some methods will require a
      * correction to the electric potential after this, as indicated by
-     * correction_required. The correction is applied by solving the Poisson
-     * equation again.
+     * correction_required. The correction is applied by correct(), or if
+     * that is not possible, by solving the Poisson equation again.
      */
     virtual void post_solve(const df::Function &phi, Mesh &mesh) = 0;
 
+    /**
+     * @brief Correct the electric potential without solving again
+     * @param[in, out]  phi     Electric potential
+     * @return                  Whether the correction was applied
+     * @see post_solve, correction_required
+     *
+     * Methods for which the correction can be computed cheaper than by
+     * solving the Poisson equation again (e.g. by superposition) may
+     * override this. If false is returned the Poisson equation is solved
+     * again instead.
+     */
+    virtual bool correct(df::Function &phi){ return false; };
+
     //! Number of objects
     std::size_t num_objects;
 
@@ -236,6 +265,53 @@ protected:
     std::vector<std::vector<int>> groups;
 };
 
+/**
+ * @brief A linear functional w.x with a sparse weight vector w
+ *
+ * Only the non-zero weights and their (local) dofs are stored, so evaluating
+ * the functional only reads the entries of x at those dofs.
+ */
+class SparseFunctional {
+public:
+    /**
+     * @brief Constructor
+     * @param   w   Weight vector. Entries which are exactly zero are dropped.
+     */
+    SparseFunctional(const df::GenericVector &w);
+
+    /**
+     * @brief Evaluates the functional
+     * @param   x   Vector with the same layout as w
+     * @return      w.x summed over all processes
+     */
+    double operator()(const df::GenericVector &x) const;
+
+    std::vector<df::la_index> dofs; ///< Local dofs of the non-zero weights
+    std::vector<double> weights;    ///< Non-zero weights
+
+private:
+    MPI_Comm comm;
+    mutable std::vector<double> values;
+};
+
+/**
+ * @brief Functional giving the charge on an object
+ * @param   V       Function space of the electric potential
+ * @param   mesh    The mesh
+ * @param   bnd_id  Boundary id of the object
+ * @param   eps0    Vacuum permittivity
+ * @return          Functional w such that the charge is w(phi.vector())
+ *
+ * The charge on an object, i.e., the integral of eps0*grad(phi).n over its
+ * surface, is linear in phi, and only depends on the dofs near the object.
+ * Assembling the weights once is much cheaper than assembling the surface
+ * integral for each phi.
+ */
+SparseFunctional charge_functional(const df::FunctionSpace &V,
+                                   const Mesh &mesh,
+                                   std::size_t bnd_id,
+                                   double eps0 = 1.0);
+
 /**
  * @name Printing functions
  *
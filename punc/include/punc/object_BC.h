@@ -59,11 +59,12 @@ public:
 
     void apply(df::GenericVector &b);
     void apply(df::GenericMatrix &A);
+    bool vector_dofs(std::vector<df::la_index> &dofs, bool &potential) const;
 
 private:
     friend class CircuitBC;
     df::MeshFunction<std::size_t> bnd;
-    std::shared_ptr<df::Form> charge_form;
+    std::shared_ptr<SparseFunctional> charge_weights;
     std::vector<df::la_index> dofs;
     std::size_t num_dofs;
     df::la_index get_free_row();
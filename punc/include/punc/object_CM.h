@@ -21,9 +21,10 @@
  *
  * Solves a particular solution of the equation with zero Dirichlet boundary
  * conditions, and then computes the mirror charge this leads to on the
- * objects, and uses this to compute the correct potential. A second solution
- * with the correct Dirichlet boundary conditions yields the correct solution.
- * Same method as described in PTetra paper.
+ * objects, and uses this to compute the correct potential. The correct
+ * solution is obtained by adding the Laplace solution of each object scaled
+ * by its potential, which is equivalent to a second solution with the correct
+ * Dirichlet boundary conditions. Same method as described in PTetra paper.
  */
 
 #ifndef OBJECT_CM_H
@@ -40,16 +41,45 @@
 #include <boost/numeric/ublas/matrix_proxy.hpp>
 #include <boost/numeric/ublas/io.hpp>
 
+#include <Eigen/Dense>
+
 namespace punc {
 
 namespace df = dolfin;
 
 using boost_matrix = boost::numeric::ublas::matrix<double>;
 
+/**
+ * @brief Solves Laplace's equation once for each object
+ * @param   V           Function space
+ * @param   objects     Objects
+ * @param   mesh        The mesh
+ * @param   eps0        Vacuum permittivity
+ * @return              One solution per object
+ *
+ * Solution j has potential 1 on object j and zero on all other objects and
+ * on the exterior boundary.
+ */
+std::vector<df::Function> laplace_solver(const df::FunctionSpace &V,
+                                         std::vector<std::shared_ptr<Object>> &objects,
+                                         Mesh &mesh, double eps0 = 1.0);
+
 boost_matrix inv_capacitance(const df::FunctionSpace &V,
                              std::vector<std::shared_ptr<Object>> &objects,
                              Mesh &mesh, double eps0 = 1.0);
 
+/**
+ * @brief Inverse capacitance matrix from precomputed Laplace solutions
+ *
+ * The charges are computed using charge_functional().
+ * @param   laplace_solutions   Solutions from laplace_solver()
+ * @param   mesh                The mesh
+ * @param   eps0                Vacuum permittivity
+ * @return                      The inverse capacitance matrix
+ */
+boost_matrix inv_capacitance(const std::vector<df::Function> &laplace_solutions,
+                             Mesh &mesh, double eps0 = 1.0);
+
 void reset_objects(std::vector<std::shared_ptr<Object>> &objects);
 
 class ObjectCM : public Object, public df::DirichletBC
@@ -60,6 +90,7 @@ public:
     void set_potential(double voltage);
     void apply(df::GenericVector &b);
     void apply(df::GenericMatrix &A);
+    bool vector_dofs(std::vector<df::la_index> &dofs, bool &potential) const;
 private:
     friend class CircuitCM;
     double image_charge = 0;
@@ -70,30 +101,60 @@ class CircuitCM : public Circuit
 public:
     std::vector<std::shared_ptr<ObjectCM>> objects;
 
+    /**
+     * @brief Constructor
+     * @param   V               Function space
+     * @param   object_vector   Objects
+     * @param   vsources        Voltage sources
+     * @param   isources        Current sources
+     * @param   mesh            The mesh
+     * @param   dt              Time-step
+     * @param   eps0            Vacuum permittivity
+     * @param   cache_fname     File caching the Laplace solutions and the
+     *                          inverse capacitance matrix (disabled if empty)
+     *
+     * Computing the Laplace solutions requires one solve per object. If
+     * cache_fname is given and holds a cache computed for the same mesh, dof
+     * numbering and objects, the solutions are loaded from it instead, and
+     * otherwise the cache is (re)written. Caching is only done in serial.
+     */
     CircuitCM(const df::FunctionSpace &V,
               ObjectVector &object_vector,
               const VSourceVector &vsources,
               const ISourceVector &isources,
               Mesh &mesh,
-              double dt, double eps0 = 1.0);
+              double dt, double eps0 = 1.0,
+              const std::string &cache_fname = "");
 
     void pre_solve();
     void post_solve(const df::Function &phi, Mesh &mesh);
+    bool correct(df::Function &phi);
     void apply(df::Function &phi, Mesh &mesh);
     bool check_solver_methods(std::string &method,
                               std::string &preconditioner) const;
+
+    /**
+     * @brief The Laplace solutions of the objects (see laplace_solver())
+     */
+    const std::vector<df::Function> &get_laplace_solutions() const
+    {
+        return laplace_solutions;
+    }
 private:
     void downcast_objects(const ObjectVector &source);
     void assemble_matrix();
     void assemble_vector();
     void apply_isources_to_object();
 
-    boost_matrix inv_circuit_mat;
+    //! LU factorization of the circuit matrix (see assemble_matrix())
+    Eigen::PartialPivLU<Eigen::MatrixXd> circuit_lu;
     boost_matrix inv_capacitance_mat;
-    std::vector<double> circuit_vector;
+    std::vector<df::Function> laplace_solutions;
+    Eigen::VectorXd circuit_vector;
     std::vector<std::vector<std::size_t>> fixed_voltage;
 
-    std::shared_ptr<df::Form> image_charge;
+    //! Functionals giving the image charge on each object
+    std::vector<SparseFunctional> image_charge;
     
     //! The time-step
     double dt;
@@ -24,6 +24,7 @@
 #define POISSON_H
 
 #include "object.h"
+#include "setup_cache.h"
 
 #include <dolfin/function/Expression.h>
 #include <dolfin/mesh/SubDomain.h>
@@ -32,6 +33,7 @@
 #include <dolfin/fem/DirichletBC.h>
 #include <dolfin/la/PETScVector.h>
 #include <dolfin/la/PETScKrylovSolver.h>
+#include <dolfin/la/PETScLUSolver.h>
 #include <dolfin/la/VectorSpaceBasis.h>
 
 #include <boost/optional.hpp>
@@ -173,6 +175,20 @@ df::FunctionSpace DG0_space(const Mesh &mesh);
  */
 df::FunctionSpace DG0_vector_space(const Mesh &mesh);
 
+/**
+ * @brief Convergence statistics of the linear algebra solver
+ * @see PoissonSolver::stats
+ */
+struct SolverStatistics
+{
+    std::size_t iterations = 0; ///< Number of Krylov iterations
+    double residual = 0;        ///< Final residual norm reported by the solver
+    double time = 0;            ///< Wall-clock time spent solving [s]
+    double tolerance = 0;       ///< Relative tolerance used (zero if direct)
+};
+
+struct Deflation;
+
 /**
  * @brief Solver for Poisson's equation
  */
@@ -181,6 +197,9 @@ private:
     boost::optional<std::vector<df::DirichletBC> &> ext_bc; /// < Exterior boundaries
     bool remove_null_space;                                 /// < Whether or not to remove null space
     std::shared_ptr<df::PETScKrylovSolver> solver;          /// < Linear algebra solver
+    std::shared_ptr<df::PETScLUSolver> lu_solver;           /// < Direct solver (direct-cached)
+    std::string preconditioner;                             /// < Preconditioner of the Krylov solver
+    std::shared_ptr<Deflation> deflation;                   /// < Deflation space (if any)
     std::shared_ptr<df::Form> a;                            /// < Bilinear form
     std::shared_ptr<df::Form> L;                            /// < Linear form
     df::PETScMatrix A;                                      /// < Stiffness matrix
@@ -188,7 +207,53 @@ private:
     std::shared_ptr<df::VectorSpaceBasis> null_space;
     std::size_t num_bcs = 0;                                ///< Number of boundaries
 
+    /**
+     * @name Precomputed boundary conditions for the load vector
+     *
+     * The first num_fixed_dofs entries of bc_dofs have constant values, while
+     * the remaining are set to the potential of the objects in bc_objects.
+     * See compile_bcs().
+     */
+    ///@{
+    bool bcs_compiled = false;
+    std::size_t num_compiled_objects = 0;
+    std::size_t num_fixed_dofs = 0;
+    std::vector<df::la_index> bc_dofs;
+    std::vector<double> bc_values;
+    std::vector<std::size_t> bc_objects;
+    ///@}
+
+    /**
+     * @brief Precomputes the entries in b set by exterior and object BCs
+     * @param   objects     A vector of objects
+     *
+     * The exterior boundary conditions are evaluated once, and together with
+     * the dofs of the objects (see Object::vector_dofs) this allows applying
+     * all of them at once with a single indexed insertion. If any object
+     * cannot describe its boundary condition this way the ordinary apply(b)
+     * methods are used instead.
+     */
+    void compile_bcs(ObjectVector &objects);
+
+    //! Loads the operator A from PETSc binary file. Returns false on failure.
+    bool load_operator(const std::string &fname, std::size_t size);
+
+    //! Saves the operator A to PETSc binary file
+    void save_operator(const std::string &fname);
+
+    //! Applies boundary conditions to b and solves for phi. Used by solve().
+    void solve_system(df::Function &phi, ObjectVector &objects,
+                      std::shared_ptr<Circuit> circuit);
+
 public:
+    /**
+     * @brief Statistics of the latest call to solve() or solve_circuit()
+     *
+     * For solve_circuit() the iterations and time are summed over all solves
+     * performed, while the residual is that of the last solve.
+     */
+    SolverStatistics stats;
+
     /**
      * @brief Constructor 
      * @param V                 The function space of rho and phi
@@ -198,6 +263,22 @@ public:
      *                          (depends on normalization scheme)
      * @param method            Method of linear algebra solver
      * @param preconditioner    Preconditioner for matrix equation
+     * @param cache             Setup cache (optional)
+     *
+     * If method is "direct-cached" the matrix, including any rows added by
+     * objects and circuits, is LU-factorized once upon construction (using
+     * MUMPS if available, or else PETSc's built-in LU). Each solve is then
+     * merely a forward and backward substitution. This is typically much
+     * faster than iterative solvers for small and medium sized meshes, at
+     * the expense of memory. The preconditioner is ignored in this case.
+     *
+     * If a cache is given, the operator A, including any rows added by
+     * objects and circuits, is stored in PETSc binary format in
+     * cache->path("operator"), and loaded from there instead of being
+     * assembled when the cache is valid. The key of the cache must therefore
+     * account for the objects, the circuitry and the exterior boundary
+     * conditions. The preconditioner (e.g. the AMG hierarchy) is always set up
+     * anew.
      */
     PoissonSolver(const df::FunctionSpace &V, 
                   ObjectVector &objects,
@@ -206,7 +287,8 @@ public:
                   double eps0 = 1,
                   bool remove_null_space = false,
                   std::string method = "",
-                  std::string preconditioner = "");
+                  std::string preconditioner = "",
+                  std::shared_ptr<SetupCache> cache = nullptr);
 
     /**
      * @brief Solves Poisson's equation
@@ -225,6 +307,18 @@ public:
                ObjectVector &objects,
                std::shared_ptr<Circuit> circuit = nullptr);
 
+    /**
+     * @brief Solves Laplace's equation
+     * @param[in,out]   phi          The electric potential
+     * @param           objects      A vector of objects
+     * @see solve
+     *
+     * Same as solve() with zero charge density, except that the load vector
+     * is not assembled. Repeated solves for different object potentials
+     * share the operator and the preconditioner.
+     */
+    void solve_laplace(df::Function &phi, ObjectVector &objects);
+
     /**
      * @brief Solves Poisson's equation and associated circuit equations.
      * @param[in,out]   phi          The electric potential
@@ -254,20 +348,80 @@ public:
      */
     double residual(const df::Function &phi);
 
+    /**
+     * @brief Deflate the Krylov solver
+     * @param   vectors     Vectors spanning the deflation space
+     *
+     * With floating objects the convergence of the Krylov solver is limited
+     * by a few global modes associated with the object potentials. These are
+     * spanned by the Laplace solutions of the objects (see laplace_solver()).
+     * Given such vectors (and the constant null space vector if null space
+     * is removed) the preconditioner M is replaced by the two-level (A-DEF2)
+     * preconditioner
+     *
+     * \f[
+     * P = M^{-1} + Z E^{-1} Z^T (I - A M^{-1}),\quad E = Z^T A Z,
+     * \f]
+     *
+     * where the columns of Z are the vectors. This removes the slow modes at
+     * the cost of a few inner products per iteration. Has no effect for the
+     * direct-cached method.
+     */
+    void set_deflation(const std::vector<df::Function> &vectors);
+
+    /**
+     * @brief Memory used by the cached LU factors
+     * @return  Memory in bytes, or zero if the direct-cached method is not used
+     */
+    double factorization_memory() const;
+
     /**
      * @brief Set the absolute residual tolerance of the linear algebra backend
      * @param   tol     absolute tolerance
+     *
+     * Has no effect for the direct-cached method.
      */
     void set_abstol(double tol=1e-12){
-        solver->parameters["absolute_tolerance"] = tol;
+        if(solver) solver->parameters["absolute_tolerance"] = tol;
     };
 
     /**
      * @brief Set the relative residual tolerance of the linear algebra backend
      * @param   tol     relative tolerance
+     *
+     * Has no effect for the direct-cached method.
      */
     void set_reltol(double tol=1e-10){
-        solver->parameters["relative_tolerance"] = tol;
+        if(solver) solver->parameters["relative_tolerance"] = tol;
+    };
+
+    /**
+     * @brief Set the relative tolerance according to the noise in rho
+     * @param   particles_per_dof   Average number of simulation particles per
+     *                              degree of freedom
+     * @param   safety              Tolerance relative to the noise level
+     * @param   min_tol             Lower bound for the tolerance
+     * @return                      The chosen relative tolerance
+     *
+     * The charge density is estimated from a finite number of particles, and
+     * has a relative statistical noise of about 1/sqrt(particles_per_dof).
+     * Converging the Krylov solver much beyond this only resolves the noise.
+     * The relative tolerance is therefore set to safety/sqrt(particles_per_dof),
+     * but never below min_tol. Has no effect for the direct-cached method.
+     */
+    double set_adaptive_reltol(double particles_per_dof, double safety=1e-2,
+                               double min_tol=1e-10);
+
+    /**
+     * @brief Use the potential passed to solve() as initial guess
+     * @param   warm_start  Whether to use a nonzero initial guess
+     *
+     * The potential changes little from one time-step to the next, so
+     * starting the iterations from the previous solution typically saves
+     * most of the iterations compared to starting from zero.
+     */
+    void set_warm_start(bool warm_start=true){
+        if(solver) solver->parameters["nonzero_initial_guess"] = warm_start;
     };
 
 };
@@ -28,6 +28,7 @@
 
 #include "mesh.h"
 #include "poisson.h"
+#include "setup_cache.h"
 #include "distributions.h"
 
 #include <dolfin/mesh/Facet.h>
@@ -243,13 +244,37 @@ class Population
     std::size_t num_cells;                  ///< Number of cells in the domain
     std::vector<Cell<len>> cells;           ///< All df::Cells in the domain
 
-    Population(const Mesh &mesh);
+    /**
+     * @brief Constructor
+     * @param   mesh    The mesh
+     * @param   cache   Setup cache (optional)
+     *
+     * If a valid cache is given, the cell neighbors and the localizer (see
+     * init_localizer()) are loaded from it rather than computed. Otherwise
+     * they are computed and stored in it.
+     */
+    Population(const Mesh &mesh, std::shared_ptr<SetupCache> cache = nullptr);
     void init_localizer(const df::MeshFunction<std::size_t> &bnd);
     void save_localizer(const std::string &fname);
     void add_particles(const std::vector<double> &xs,
                        const std::vector<double> &vs,
                        double q, double m);
     void add_particles(const std::vector<Particle<len>> &ps);
+
+    /**
+     * @brief Add particles with known cells
+     * @param   xs          Positions
+     * @param   vs          Velocities
+     * @param   cell_ids    Index of the cell containing each particle
+     * @param   q           Charge
+     * @param   m           Mass
+     *
+     * Same as add_particles() but without locating the particles.
+     */
+    void add_particles(const std::vector<double> &xs,
+                       const std::vector<double> &vs,
+                       const std::vector<signed long int> &cell_ids,
+                       double q, double m);
     signed long int locate(const double *p);
     signed long int relocate(const double *p, signed long int cell_id);
     signed long int relocate_stat(const double *p, signed long int cell_id, int &crossings);
@@ -308,37 +333,100 @@ class Population
 };
 
 template <std::size_t len>
-Population<len>::Population(const Mesh &mesh_)
+Population<len>::Population(const Mesh &mesh_, std::shared_ptr<SetupCache> cache)
     : mesh(mesh_.mesh), g_dim(mesh_.mesh->geometry().dim()),
       t_dim(mesh_.mesh->topology().dim()), num_cells(mesh_.mesh->num_cells())
 {
-
-    for (df::MeshEntityIterator e(*(mesh), t_dim); !e.end(); ++e)
+    // Neighbors of cell i are neighbors[offsets[i]] to neighbors[offsets[i+1]]
+    std::vector<std::size_t> offsets, neighbors;
+
+    // Localizer with a fixed number of entries per facet
+    std::vector<signed long int> facet_adjacents;
+    std::vector<double> facet_plane_coeffs;
+    auto num_facets = num_cells * (t_dim + 1);
+
+    bool cached = cache &&
+                  cache->get("localizer.offsets", offsets) &&
+                  cache->get("localizer.neighbors", neighbors) &&
+                  cache->get("localizer.facet_adjacents", facet_adjacents) &&
+                  cache->get("localizer.facet_plane_coeffs", facet_plane_coeffs) &&
+                  offsets.size() == num_cells + 1 &&
+                  facet_adjacents.size() == num_facets &&
+                  facet_plane_coeffs.size() == num_facets * (g_dim + 1);
+
+    if (!cached)
     {
-        std::vector<std::size_t> neighbors;
-        auto cell_id = e->index();
-        auto num_vertices = e->num_entities(0);
-        for (std::size_t i = 0; i < num_vertices; ++i)
+        offsets.assign(1, 0);
+        neighbors.clear();
+        for (df::MeshEntityIterator e(*(mesh), t_dim); !e.end(); ++e)
         {
-            df::Vertex vertex(*mesh, e->entities(0)[i]);
-            auto vertex_cells = vertex.entities(t_dim);
-            auto num_adj_cells = vertex.num_entities(t_dim);
-            for (std::size_t j = 0; j < num_adj_cells; ++j)
+            auto begin = neighbors.size();
+            auto cell_id = e->index();
+            auto num_vertices = e->num_entities(0);
+            for (std::size_t i = 0; i < num_vertices; ++i)
             {
-                if (cell_id != vertex_cells[j])
+                df::Vertex vertex(*mesh, e->entities(0)[i]);
+                auto vertex_cells = vertex.entities(t_dim);
+                auto num_adj_cells = vertex.num_entities(t_dim);
+                for (std::size_t j = 0; j < num_adj_cells; ++j)
                 {
-                    neighbors.push_back(vertex_cells[j]);
+                    if (cell_id != vertex_cells[j])
+                    {
+                        neighbors.push_back(vertex_cells[j]);
+                    }
                 }
             }
+            std::sort(neighbors.begin() + begin, neighbors.end());
+            neighbors.erase(std::unique(neighbors.begin() + begin, neighbors.end()), neighbors.end());
+            offsets.push_back(neighbors.size());
         }
-        std::sort(neighbors.begin(), neighbors.end());
-        neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+    }
 
-        Cell<len> cell(mesh, cell_id, neighbors);
+    for (std::size_t cell_id = 0; cell_id < num_cells; ++cell_id)
+    {
+        std::vector<std::size_t> cell_neighbors(neighbors.begin() + offsets[cell_id],
+                                                neighbors.begin() + offsets[cell_id + 1]);
+        Cell<len> cell(mesh, cell_id, cell_neighbors);
         cells.emplace_back(cell);
     }
 
-    init_localizer(mesh_.bnd);
+    if (cached)
+    {
+        auto n = t_dim + 1;
+        auto m = n * (g_dim + 1);
+        for (auto &cell : cells)
+        {
+            auto id = cell.id;
+            cell.facet_adjacents.assign(facet_adjacents.begin() + id * n,
+                                        facet_adjacents.begin() + (id + 1) * n);
+            cell.facet_plane_coeffs.assign(facet_plane_coeffs.begin() + id * m,
+                                           facet_plane_coeffs.begin() + (id + 1) * m);
+        }
+    }
+    else
+    {
+        init_localizer(mesh_.bnd);
+
+        if (cache)
+        {
+            facet_adjacents.clear();
+            facet_plane_coeffs.clear();
+            for (auto &cell : cells)
+            {
+                facet_adjacents.insert(facet_adjacents.end(),
+                                       cell.facet_adjacents.begin(),
+                                       cell.facet_adjacents.end());
+                facet_plane_coeffs.insert(facet_plane_coeffs.end(),
+                                          cell.facet_plane_coeffs.begin(),
+                                          cell.facet_plane_coeffs.end());
+            }
+            cache->set("localizer.offsets", offsets);
+            cache->set("localizer.neighbors", neighbors);
+            cache->set("localizer.facet_adjacents", facet_adjacents);
+            cache->set("localizer.facet_plane_coeffs", facet_plane_coeffs);
+        }
+    }
+
     save_localizer("localizer.dat");
 }
 
@@ -434,6 +522,19 @@ void Population<len>::add_particles(const std::vector<double> &xs,
     }
 }
 
+template <std::size_t len>
+void Population<len>::add_particles(const std::vector<double> &xs,
+                                    const std::vector<double> &vs,
+                                    const std::vector<signed long int> &cell_ids,
+                                    double q, double m)
+{
+    for (std::size_t i = 0; i < cell_ids.size(); ++i)
+    {
+        Particle<len> particle(&xs[i * g_dim], &vs[i * g_dim], q, m);
+        cells[cell_ids[i]].particles.push_back(particle);
+    }
+}
+
 template <std::size_t len>
 void Population<len>::add_particles(const std::vector<Particle<len>> &ps)
 {
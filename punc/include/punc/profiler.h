@@ -0,0 +1,302 @@
+// Copyright (C) 2018, Diako Darian and Sigvald Marholm
+//
+// This file is part of PUNC++.
+//
+// PUNC++ is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// PUNC++ is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// PUNC++. If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ * @file		profiler.h
+ * @brief		Hierarchical profiling of time-steps
+ */
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace punc
+{
+
+/**
+ * @brief Hardware performance counters of the calling thread
+ *
+ * Counts cycles, instructions, last-level cache misses and branch misses by
+ * means of Linux' perf_event_open(2), as a group such that all events are
+ * counted over the same intervals. If the kernel has to multiplex the
+ * counters, the counts are scaled by the fraction of time they were running.
+ *
+ * Counters may be unavailable, e.g. on other platforms than Linux, in virtual
+ * machines without a PMU, or when /proc/sys/kernel/perf_event_paranoid does
+ * not allow user-space profiling. open() then returns false. Events which
+ * are unavailable while the others are not are read as NaN.
+ */
+class HardwareCounters
+{
+public:
+    enum Event
+    {
+        cycles,
+        instructions,
+        cache_misses,   ///< Last-level cache misses
+        branch_misses,
+        num_events
+    };
+
+    typedef std::array<double, num_events> Values;
+
+    HardwareCounters() { fds.fill(-1); }
+    ~HardwareCounters() { close(); }
+
+    HardwareCounters(const HardwareCounters &) = delete;
+    HardwareCounters &operator=(const HardwareCounters &) = delete;
+
+    /**
+     * @brief Starts counting for the calling thread
+     * @return  True if counting
+     */
+    bool open();
+
+    /**
+     * @brief Stops counting
+     */
+    void close();
+
+    /**
+     * @brief Whether counting
+     */
+    bool is_open() const { return fds[cycles] >= 0; }
+
+    /**
+     * @brief Reads the number of events since open()
+     * @param[out]  values  Number of each event (zeros if not counting)
+     */
+    void read(Values &values) const;
+
+private:
+    std::array<int, num_events> fds;
+};
+
+/**
+ * @brief Hierarchical profiler with per-step statistics and trace export
+ *
+ * Scopes are opened by begin() and closed by end() (or by a ProfilerScope),
+ * and may be nested. Each thread has its own tree of scopes, such that no
+ * locking is needed while timing. Threads which have finished hand their
+ * tree over to the next thread that is started, such that short-lived
+ * worker threads (e.g. in inject_particles()) do not accumulate trees.
+ *
+ * Counters, e.g. the number of particles or Krylov iterations, are added to
+ * by count(). At the end of every time-step, step() records the time spent
+ * in each scope and the value of each counter during the step. From these,
+ * summary() prints the total time, as well as the mean, minimum, maximum and
+ * 95th percentile per step. Spikes in individual steps, e.g., due to file
+ * output, can thus be told apart from steady costs.
+ *
+ * Optionally, the per-step records are streamed to a CSV file (open_csv())
+ * with the columns step, type (time or counter), name and value, where the
+ * name of a scope is its path, e.g. "step/poisson". Every scope can also be
+ * recorded as an event in the Chrome trace-event format (enable_trace() and
+ * write_trace()), which can be viewed in chrome://tracing or Perfetto.
+ *
+ * Hardware performance counters (see HardwareCounters) can be collected for
+ * each scope by enable_hardware_counters(). The summary then also lists the
+ * instructions per cycle and the memory traffic of each scope, estimated as
+ * one cache line per last-level cache miss. The traffic is given in bytes per
+ * second, and per particle when normalized by a counter of particles. This
+ * tells whether a kernel is bound by bandwidth (traffic near the bandwidth of
+ * the node), by latency (low traffic and low IPC) or by computation (high
+ * IPC). Counting costs a system call when opening and closing each scope.
+ *
+ * There is one profiler for the process, accessed by instance().
+ *
+ * @code
+ *  auto &profiler = Profiler::instance();
+ *  for(std::size_t n = 0; n < steps; ++n){
+ *      ProfilerScope scope("poisson");
+ *      ...
+ *      profiler.count("iterations", iterations);
+ *      profiler.step(n);
+ *  }
+ *  profiler.summary();
+ * @endcode
+ */
+class Profiler
+{
+public:
+    /**
+     * @brief The profiler of the process
+     */
+    static Profiler &instance();
+
+    /**
+     * @brief Opens a scope nested in the currently open scope of the thread
+     * @param   name    Name of the scope
+     */
+    void begin(const std::string &name);
+
+    /**
+     * @brief Closes the most recently opened scope of the thread
+     */
+    void end();
+
+    /**
+     * @brief Adds to a counter for the current step
+     * @param   name    Name of the counter
+     * @param   value   Value to add
+     */
+    void count(const std::string &name, double value);
+
+    /**
+     * @brief Finishes a time-step
+     * @param   n   The time-step
+     *
+     * Must be called while no other threads are profiled.
+     */
+    void step(std::size_t n);
+
+    /**
+     * @brief Streams the per-step records to a CSV file
+     * @param   fname   File name
+     */
+    void open_csv(const std::string &fname);
+
+    /**
+     * @brief Starts recording trace events
+     */
+    void enable_trace();
+
+    /**
+     * @brief Starts collecting hardware performance counters for each scope
+     * @param   particles   Counter of particles by which to normalize memory
+     *                      traffic (see count())
+     * @return              False if counters are unavailable (a warning is
+     *                      printed and profiling continues without them)
+     *
+     * Only affects scopes opened after this call.
+     */
+    bool enable_hardware_counters(const std::string &particles = "particles");
+
+    /**
+     * @brief Writes the recorded trace events in the Chrome trace-event format
+     * @param   fname   File name
+     */
+    void write_trace(const std::string &fname);
+
+    /**
+     * @brief Prints the statistics of all scopes and counters
+     * @param   order   Top-level scopes to list first (optional)
+     */
+    void summary(const std::vector<std::string> &order = {});
+
+    /**
+     * @brief Time since the profiler was created
+     * @return  Time in seconds
+     */
+    double elapsed() const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    //! A scope in the tree of a thread
+    struct Node
+    {
+        std::string name;
+        std::size_t parent;
+        std::vector<std::size_t> children;
+        double total = 0;          ///< Total time
+        double step_time = 0;      ///< Time during the current step
+        std::size_t calls = 0;     ///< Number of times the scope was opened
+        std::vector<float> steps;  ///< Time during each finished step
+        HardwareCounters::Values events{};  ///< Total hardware events
+    };
+
+    //! An open scope
+    struct Frame
+    {
+        std::size_t node;
+        clock::time_point begin;
+        bool counting;                      ///< Whether events were read at begin
+        HardwareCounters::Values events;    ///< Hardware events at begin
+    };
+
+    //! A trace event (complete event)
+    struct Event
+    {
+        std::size_t node;
+        double begin, duration;    ///< Microseconds since the start
+    };
+
+    //! Profiling data of one thread
+    struct ThreadData
+    {
+        std::size_t id;
+        std::vector<Node> nodes;                     ///< Node 0 is the root
+        std::vector<Frame> stack;
+        std::map<std::string, double> counters;      ///< Counters of the current step
+        std::vector<Event> events;
+        HardwareCounters hardware;
+    };
+
+    std::mutex mutex;                                ///< Guards threads and free
+    std::vector<std::unique_ptr<ThreadData>> threads;
+    std::vector<ThreadData *> free;                  ///< Trees of finished threads
+
+    clock::time_point start;
+    std::size_t num_steps = 0;
+    bool trace = false;
+    bool hardware = false;
+    std::string particles;                           ///< Normalization of traffic
+    std::ofstream csv;
+
+    //! Per-step values of each counter
+    std::map<std::string, std::vector<double>> counters;
+
+    //! End of each step in microseconds since the start (when tracing)
+    std::vector<double> step_ends;
+
+    Profiler();
+    ThreadData &thread_data();
+    void release(ThreadData *data);
+    std::string path(const ThreadData &data, std::size_t node) const;
+
+    friend struct ThreadHandle;
+};
+
+/**
+ * @brief Profiles a scope from construction to destruction
+ */
+class ProfilerScope
+{
+public:
+    /**
+     * @brief Constructor
+     * @param   name    Name of the scope
+     */
+    ProfilerScope(const std::string &name) { Profiler::instance().begin(name); }
+    ~ProfilerScope() { Profiler::instance().end(); }
+
+    ProfilerScope(const ProfilerScope &) = delete;
+    ProfilerScope &operator=(const ProfilerScope &) = delete;
+};
+
+} // namespace punc
+
+#endif // PROFILER_H
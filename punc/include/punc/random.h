@@ -0,0 +1,262 @@
+// Copyright (C) 2018, Diako Darian and Sigvald Marholm
+//
+// This file is part of PUNC++.
+//
+// PUNC++ is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// PUNC++ is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// PUNC++. If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ * @file		random.h
+ * @brief		Reproducible random number streams
+ */
+
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace punc
+{
+
+/**
+ * @brief Sets the global seed of all random streams
+ * @param seed  The seed
+ */
+void set_seed(std::uint64_t seed);
+
+/**
+ * @brief The global seed of all random streams
+ * @return  The seed
+ *
+ * Unless set by set_seed(), the seed is drawn from std::random_device upon
+ * the first call.
+ */
+std::uint64_t get_seed();
+
+/**
+ * @brief What a random stream is used for
+ */
+enum class RandomStreamType
+{
+    load,   ///< Loading of particles
+    inject  ///< Injection of particles
+};
+
+/**
+ * @brief Counter-based random number stream (Philox4x32-10)
+ *
+ * The Philox generator of Salmon et al., "Parallel random numbers: as easy
+ * as 1, 2, 3", SC'11 (2011), maps a 128-bit counter and a 64-bit key to 128
+ * random bits by ten rounds of multiplications and xors. Since there is no
+ * state other than the counter, any number of independent streams can be
+ * created at no cost.
+ *
+ * The key is the global seed (see get_seed()), while the upper half of the
+ * counter identifies the stream by hashing its type, the time-step, the
+ * species and a block (e.g. a facet or a group of cells). The lower half
+ * counts the numbers drawn from the stream. The numbers drawn for a given
+ * block are therefore the same irrespective of the order in which, or the
+ * thread by which, the blocks are processed.
+ *
+ * RandomStream satisfies the UniformRandomBitGenerator concept, and can be
+ * used with the distributions in <random>. In addition, uniform() and
+ * normal() draw numbers in bulk.
+ */
+class RandomStream
+{
+public:
+    using result_type = std::uint64_t;
+
+    /**
+     * @brief Constructor
+     * @param type      What the stream is used for
+     * @param step      Time-step
+     * @param species   Species index
+     * @param block     Block index (e.g. facet or group of cells)
+     * @param seed      Seed (key)
+     */
+    RandomStream(RandomStreamType type, std::uint64_t step,
+                 std::uint64_t species, std::uint64_t block,
+                 std::uint64_t seed = get_seed())
+        : key{{static_cast<std::uint32_t>(seed),
+               static_cast<std::uint32_t>(seed >> 32)}}
+    {
+        stream = mix(static_cast<std::uint64_t>(type));
+        stream = mix(stream ^ step);
+        stream = mix(stream ^ species);
+        stream = mix(stream ^ block);
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return ~result_type(0); }
+
+    /**
+     * @brief Next 64 random bits
+     */
+    result_type operator()()
+    {
+        if (buffered == 0)
+        {
+            auto r = block(position++);
+            buffer[0] = r[0] | (std::uint64_t(r[1]) << 32);
+            buffer[1] = r[2] | (std::uint64_t(r[3]) << 32);
+            buffered = 2;
+        }
+        return buffer[2 - buffered--];
+    }
+
+    /**
+     * @brief Uniformly distributed numbers in (0,1)
+     * @param[out]  xs  Array of n numbers
+     * @param       n   Number of random numbers
+     */
+    void uniform(double *xs, std::size_t n)
+    {
+        buffered = 0;
+        std::size_t i = 0;
+        for (; i + 1 < n; i += 2)
+        {
+            auto r = block(position + i / 2);
+            xs[i] = to_double(r[0], r[1]);
+            xs[i + 1] = to_double(r[2], r[3]);
+        }
+        position += n / 2;
+        if (i < n)
+        {
+            auto r = block(position++);
+            xs[i] = to_double(r[0], r[1]);
+        }
+    }
+
+    /**
+     * @brief Standard normally distributed numbers (Box-Muller transform)
+     * @param[out]  xs  Array of n numbers
+     * @param       n   Number of random numbers
+     */
+    void normal(double *xs, std::size_t n)
+    {
+        uniform(xs, n);
+        std::size_t i = 0;
+        for (; i + 1 < n; i += 2)
+        {
+            double r = std::sqrt(-2.0 * std::log(xs[i]));
+            double theta = 2.0 * M_PI * xs[i + 1];
+            xs[i] = r * std::cos(theta);
+            xs[i + 1] = r * std::sin(theta);
+        }
+        if (i < n)
+        {
+            double u;
+            uniform(&u, 1);
+            xs[i] = std::sqrt(-2.0 * std::log(xs[i])) * std::cos(2.0 * M_PI * u);
+        }
+    }
+
+private:
+    std::array<std::uint32_t, 2> key; ///< Key (seed)
+    std::uint64_t stream;             ///< Upper half of the counter
+    std::uint64_t position = 0;       ///< Lower half of the counter
+    std::uint64_t buffer[2];          ///< Unused output of the latest block
+    int buffered = 0;                 ///< Number of unused outputs in buffer
+
+    //! 64-bit finalizer of SplitMix64, used to hash the stream identifiers
+    static std::uint64_t mix(std::uint64_t z)
+    {
+        z += 0x9E3779B97F4A7C15ull;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    //! Maps 64 random bits to (0,1)
+    static double to_double(std::uint32_t lo, std::uint32_t hi)
+    {
+        std::uint64_t x = lo | (std::uint64_t(hi) << 32);
+        return ((x >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+    }
+
+    //! The Philox4x32-10 bijection of the counter (position, stream)
+    std::array<std::uint32_t, 4> block(std::uint64_t pos) const
+    {
+        std::array<std::uint32_t, 4> c{{static_cast<std::uint32_t>(pos),
+                                        static_cast<std::uint32_t>(pos >> 32),
+                                        static_cast<std::uint32_t>(stream),
+                                        static_cast<std::uint32_t>(stream >> 32)}};
+        std::uint32_t k0 = key[0], k1 = key[1];
+        for (int round = 0; round < 10; ++round)
+        {
+            std::uint64_t p0 = std::uint64_t(0xD2511F53u) * c[0];
+            std::uint64_t p1 = std::uint64_t(0xCD9E8D57u) * c[2];
+            c = {{static_cast<std::uint32_t>(p1 >> 32) ^ c[1] ^ k0,
+                  static_cast<std::uint32_t>(p1),
+                  static_cast<std::uint32_t>(p0 >> 32) ^ c[3] ^ k1,
+                  static_cast<std::uint32_t>(p0)}};
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        return c;
+    }
+};
+
+/**
+ * @brief Alias table for sampling a discrete distribution in constant time
+ *
+ * Walker's alias method, as constructed by Vose, "A linear algorithm for
+ * generating random numbers with a given distribution", IEEE Trans. Softw.
+ * Eng. 17 (1991). Each of the n bins holds a probability and an alias, such
+ * that a sample costs one uniform random number regardless of n.
+ */
+class AliasTable
+{
+public:
+    AliasTable() {}
+
+    /**
+     * @brief Constructor
+     * @param weights   Non-negative (unnormalized) weight of each index
+     */
+    AliasTable(const std::vector<double> &weights);
+
+    /**
+     * @brief Number of indices
+     */
+    std::size_t size() const { return prob.size(); }
+
+    /**
+     * @brief Draws an index
+     * @param u     Uniformly distributed random number in [0,1)
+     * @return      Index i with probability proportional to its weight
+     */
+    std::size_t operator()(double u) const
+    {
+        double x = u * prob.size();
+        auto i = static_cast<std::size_t>(x);
+        if (i >= prob.size())
+        {
+            i = prob.size() - 1;
+        }
+        return (x - i) < prob[i] ? i : alias[i];
+    }
+
+private:
+    std::vector<double> prob;        ///< Probability of keeping each bin
+    std::vector<std::size_t> alias;  ///< Alternative index of each bin
+};
+
+} // namespace punc
+
+#endif // RANDOM_H
@@ -0,0 +1,163 @@
+// Copyright (C) 2018, Diako Darian and Sigvald Marholm
+//
+// This file is part of PUNC++.
+//
+// PUNC++ is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// PUNC++ is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// PUNC++. If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ * @file		setup_cache.h
+ * @brief		Cache for quantities computed during setup
+ */
+
+#ifndef SETUP_CACHE_H
+#define SETUP_CACHE_H
+
+#include "mesh.h"
+#include <dolfin/function/FunctionSpace.h>
+#include <dolfin/common/MPI.h>
+#include <cstring>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace punc {
+
+namespace df = dolfin;
+
+/**
+ * @brief Hash identifying a mesh and the dof numbering of a function space
+ * @param   V       Function space
+ * @param   mesh    The mesh
+ * @return          Hash of the mesh (see Mesh::hash()) and the dofmap
+ *
+ * Quantities computed during setup are only valid for the same mesh and dof
+ * numbering. A hash of any other parameters they depend on must be combined
+ * with this to form the key of a SetupCache.
+ */
+std::size_t setup_key(const df::FunctionSpace &V, const Mesh &mesh);
+
+/**
+ * @brief Named arrays of setup quantities persisted between runs
+ *
+ * Setting up a simulation involves several costly computations which only
+ * depend on the mesh and a few parameters, e.g. the localizer, the vertex
+ * volumes and the fluxes through the exterior facets. These can be stored as
+ * named arrays in a SetupCache, which is written to file by save(). Upon
+ * construction, the arrays are loaded from file if it was written with the
+ * same key. Otherwise the cache starts out empty and the stale file is
+ * removed.
+ *
+ * Quantities better stored in other formats (like PETSc matrices) can be put
+ * in separate files named by path(). These are only to be trusted if valid()
+ * is true.
+ *
+ * The file stores the raw bytes of the arrays and is not portable between
+ * platforms. Caching is only done in serial, and is disabled in parallel.
+ *
+ * @code
+ *  SetupCache cache("setup.dat", key);
+ *  std::vector<double> dv_inv;
+ *  if(!cache.get("dv_inv", dv_inv)){
+ *      dv_inv = element_volume(V);
+ *      cache.set("dv_inv", dv_inv);
+ *  }
+ *  cache.save();
+ * @endcode
+ */
+class SetupCache
+{
+public:
+    /**
+     * @brief Constructor
+     * @param   fname   File name
+     * @param   key     Key identifying the setup (see setup_key())
+     * @param   comm    MPI communicator. Caching is disabled in parallel.
+     */
+    SetupCache(const std::string &fname, std::size_t key,
+               MPI_Comm comm = MPI_COMM_WORLD);
+
+    /**
+     * @brief Whether the file was written with the same key
+     */
+    bool valid() const { return loaded; }
+
+    /**
+     * @brief Whether caching is enabled (serial runs only)
+     */
+    bool enabled() const { return active; }
+
+    /**
+     * @brief File name for quantities stored in separate files
+     * @param   name    Name of the quantity
+     * @return          File name next to the cache file
+     */
+    std::string path(const std::string &name) const;
+
+    /**
+     * @brief Get an array
+     * @param       name    Name of the array
+     * @param[out]  data    The array (untouched if not present)
+     * @return              True if present
+     */
+    template <typename T>
+    bool get(const std::string &name, std::vector<T> &data) const
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "SetupCache only stores trivially copyable types");
+
+        auto it = entries.find(name);
+        if (it == entries.end() || it->second.size() % sizeof(T) != 0)
+            return false;
+
+        data.resize(it->second.size() / sizeof(T));
+        if (!data.empty())
+            std::memcpy(data.data(), it->second.data(), it->second.size());
+        return true;
+    }
+
+    /**
+     * @brief Set an array
+     * @param   name    Name of the array
+     * @param   data    The array
+     */
+    template <typename T>
+    void set(const std::string &name, const std::vector<T> &data)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "SetupCache only stores trivially copyable types");
+
+        if (!active) return;
+        auto bytes = reinterpret_cast<const char *>(data.data());
+        entries[name].assign(bytes, bytes + data.size() * sizeof(T));
+        modified = true;
+    }
+
+    /**
+     * @brief Writes the cache to file if anything was set
+     */
+    void save();
+
+private:
+    std::string fname;
+    std::size_t key;
+    bool active;
+    bool loaded = false;
+    bool modified = false;
+    std::map<std::string, std::vector<char>> entries;
+};
+
+} // namespace punc
+
+#endif // SETUP_CACHE_H
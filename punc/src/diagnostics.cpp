@@ -72,8 +72,10 @@ History::History(const std::string &fname,
                  std::size_t dim,
                  bool stats,
                  bool continue_simulation,
-                 bool hex_output) 
-                 : dim(dim), stats(stats), hex_output(hex_output)
+                 bool hex_output,
+                 bool solver_stats) 
+                 : dim(dim), stats(stats), hex_output(hex_output),
+                   solver_stats(solver_stats)
 {
     if (continue_simulation)
     {
@@ -95,6 +97,10 @@ History::History(const std::string &fname,
         {
             ofile << "\tmean_e\tstdev_e\tmean_i\tstdev_i";
         }
+        if (solver_stats)
+        {
+            ofile << "\titer\tres\tt_solve\treltol";
+        }
         ofile << "\n";
 
         ofile << "#:long\ttimestep\ttime\t\"number of electrons\"\t";
@@ -113,6 +119,13 @@ History::History(const std::string &fname,
             ofile << "\tmean velocity of ions";
             ofile << "\tstandard deviation of ion velocities";
         }
+        if (solver_stats)
+        {
+            ofile << "\t\"Poisson solver iterations\"";
+            ofile << "\t\"Poisson solver residual\"";
+            ofile << "\t\"Poisson solver time\"";
+            ofile << "\t\"Poisson solver relative tolerance\"";
+        }
         ofile << "\n";
 
         ofile << "#:units\t1\ts\tm**(-3)\tm**(-3)\tJ\tJ";
@@ -139,13 +152,19 @@ History::History(const std::string &fname,
             ofile << "\tm/s";
             ofile << "\tm/s";
         }
+        if (solver_stats)
+        {
+            ofile << "\t1";
+            ofile << "\t1";
+            ofile << "\ts";
+            ofile << "\t1";
+        }
         ofile << "\n";
     }
 }
 
 Timer::Timer(std::vector<std::string> tasks) 
-            : tasks(tasks), times(std::vector<double>(tasks.size(), 0.0)),
-              _begin(_clock::now()) 
+            : tasks(tasks), _begin(_clock::now()) 
 {
     // Do nothing
 }
@@ -176,13 +195,12 @@ void Timer::progress(std::size_t n, std::size_t steps, std::size_t n_previous,
 
 void Timer::tic(std::string tag)
 {
-    _index = std::distance(tasks.begin(), std::find(tasks.begin(), tasks.end(), tag));
-    _time = _clock::now();
+    Profiler::instance().begin(tag);
 }
 
 void Timer::toc()
 {
-    times[_index] += std::chrono::duration_cast<_second>(_clock::now() - _time).count();
+    Profiler::instance().end();
 }
 
 double Timer::elapsed() const
@@ -192,42 +210,7 @@ double Timer::elapsed() const
 
 void Timer::summary()
 {
-    auto total_time = elapsed();
-
-    std::size_t len = 0;
-    for (std::size_t i = 0; i < tasks.size(); ++i)
-    {
-        len = tasks[i].length() > len ? tasks[i].length() : len;
-    }
-
-    std::vector<std::string> times_formatted(tasks.size());
-    for (std::size_t i = 0; i < tasks.size(); ++i)
-    {
-        times_formatted[i] = formatter(times[i]);
-    }
-
-    std::cout << std::setw(len + 8 + 24 + 5 + 5) << std::setfill('-') << "-" << '\n';
-    std::cout << std::setfill(' ') << std::right << std::setw(len + 16) 
-              << "Summary of tasks" << '\n';
-    std::cout << std::setw(len + 8 + 24 + 5 + 5) << std::setfill('-') << "-" << '\n';
-    std::cout << std::setfill(' ') << std::left << std::setw(len + 13) << "Task"
-              << std::left << std::setw(16) << "Time"
-              << std::left << std::setw(13) << "Percentage" << '\n';
-    std::cout << std::setw(len + 8 + 24 + 5 + 5) << std::setfill('-') << "-" << '\n';
-
-    for (std::size_t i = 0; i < times.size(); ++i)
-    {
-        std::cout <<  std::setfill(' ') 
-                  << std::left << std::setw(len + 8) << tasks[i];
-        std::cout << std::left << std::setw(24) << times_formatted[i];
-        std::cout << std::setw(5) << std::right << std::setfill(' ')
-                  << std::setprecision(2) << std::fixed
-                  << 100 * times[i] / total_time << '\n';
-    }
-    std::cout << std::setw(len + 8 + 24 + 5 + 5) << std::setfill('-') << '\n';
-    std::cout << std::setfill(' ') << std::right << std::setw(len + 8) 
-              << "Total run time:" << formatter(total_time) << '\n';
-    std::cout << std::setw(len + 8 + 24 + 5 + 5) << std::setfill('-') << '\n';
+    Profiler::instance().summary(tasks);
 }
 
 std::string Timer::formatter(double time_range)
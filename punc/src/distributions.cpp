@@ -17,15 +17,330 @@
 
 #include "../include/punc/distributions.h"
 
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+
 namespace punc
 {
 
+void normal_icdf(double *xs, std::size_t n)
+{
+    const std::size_t block_size = 256;
+    double us[block_size];
+
+    for (std::size_t begin = 0; begin < n; begin += block_size)
+    {
+        auto size = std::min(block_size, n - begin);
+        auto x = xs + begin;
+        std::copy(x, x + size, us);
+
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            double q = us[i] - 0.5;
+            double r = 0.180625 - q * q;
+            double num = (((((((2.5090809287301226727e+3 * r +
+                                3.3430575583588128105e+4) * r +
+                                6.7265770927008700853e+4) * r +
+                                4.5921953931549871457e+4) * r +
+                                1.3731693765509461125e+4) * r +
+                                1.9715909503065514427e+3) * r +
+                                1.3314166789178437745e+2) * r +
+                                3.3871328727963666080e+0) * q;
+            double den = (((((((5.2264952788528545610e+3 * r +
+                                2.8729085735721942674e+4) * r +
+                                3.9307895800092710610e+4) * r +
+                                2.1213794301586595867e+4) * r +
+                                5.3941960214247511077e+3) * r +
+                                6.8718700749205790830e+2) * r +
+                                4.2313330701600911252e+1) * r +
+                                1.0);
+            x[i] = num / den;
+        }
+
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            double q = us[i] - 0.5;
+            if (std::abs(q) <= 0.425)
+            {
+                continue;
+            }
+
+            double r = std::sqrt(-std::log(q < 0.0 ? us[i] : 1.0 - us[i]));
+            double num, den;
+            if (r <= 5.0)
+            {
+                r -= 1.6;
+                num = (((((((7.7454501427834140764e-4 * r +
+                             2.2723844989269184583e-2) * r +
+                             2.4178072517745061177e-1) * r +
+                             1.2704582524523683826e+0) * r +
+                             3.6478483247632045605e+0) * r +
+                             5.7694972214606914055e+0) * r +
+                             4.6303378461565452959e+0) * r +
+                             1.4234371107496835773e+0);
+                den = (((((((1.0507500716444168432e-9 * r +
+                             5.4759380849953449460e-4) * r +
+                             1.5198666563616457197e-2) * r +
+                             1.4810397642748007459e-1) * r +
+                             6.8976733498510000455e-1) * r +
+                             1.6763848301838038494e+0) * r +
+                             2.0531916266377588219e+0) * r +
+                             1.0);
+            }
+            else
+            {
+                r -= 5.0;
+                num = (((((((2.0103343992922881327e-7 * r +
+                             2.7115555687434875782e-5) * r +
+                             1.2426609473880784386e-3) * r +
+                             2.6532189526576123093e-2) * r +
+                             2.9656057182850489123e-1) * r +
+                             1.7848265399172913358e+0) * r +
+                             5.4637849111641143699e+0) * r +
+                             6.6579046435011037772e+0);
+                den = (((((((2.0442631033899397856e-15 * r +
+                             1.4215117583164458887e-7) * r +
+                             1.8463183175100546818e-5) * r +
+                             7.8686913114561329059e-4) * r +
+                             1.4875361290850614853e-2) * r +
+                             1.3692988092273580531e-1) * r +
+                             5.9983220655588793769e-1) * r +
+                             1.0);
+            }
+            x[i] = q < 0.0 ? -num / den : num / den;
+        }
+    }
+}
+
+/**
+ * @brief Inverse CDF of the normal velocity of a drifting Maxwellian flux
+ * @param a     Drift velocity along the normal in units of thermal velocity
+ * @param r     Uniformly distributed random number in (0, 1]
+ * @return      Normal velocity in units of thermal velocity
+ *
+ * The normal velocity x>0 is distributed as \f[x\phi(x-a)\f], where
+ * \f[\phi\f] is the standard normal distribution. The complementary CDF
+ * \f[\phi(x-a)+a\Phi(a-x)\f] (unnormalized) is set equal to r by Newton
+ * iterations safeguarded by bisection, starting from the Rayleigh (a=0) or
+ * Gaussian (large a) solution. Drifts below -30 thermal velocities are
+ * clamped, since the flux is then vanishingly small.
+ */
+static double flux_normal_icdf(double a, double r)
+{
+    auto phi = [](double z) { return exp(-0.5 * z * z) / sqrt(2 * M_PI); };
+    auto Phi = [](double z) { return 0.5 * erfc(-z / sqrt(2.0)); };
+
+    if (r >= 1.0) return 0.0;
+
+    a = std::max(a, -30.0);
+    double target = r * (phi(a) + a * Phi(a));
+
+    double x;
+    if (a > 1.0)
+    {
+        x = a + sqrt(2.0) * boost::math::erfc_inv(2.0 * r);
+    }
+    else
+    {
+        x = sqrt(-2.0 * log(r));
+    }
+
+    double lo = 0.0, hi = std::max(a, 0.0) + 40.0;
+    x = std::min(std::max(x, lo), hi);
+    for (int i = 0; i < 100; ++i)
+    {
+        double h = phi(x - a) + a * Phi(a - x) - target;
+        if (h > 0) lo = x; else hi = x;
+
+        double dh = -x * phi(x - a);
+        double x_new = (dh != 0.0) ? x - h / dh : lo;
+        if (!(x_new > lo && x_new < hi))
+        {
+            x_new = 0.5 * (lo + hi);
+        }
+        if (std::abs(x_new - x) < 1e-13 * (1.0 + x))
+        {
+            return x_new;
+        }
+        x = x_new;
+    }
+    return x;
+}
+
+/**
+ * @brief Samples the flux of a drifting Maxwellian
+ * @param[in]  n    - unit normal vector (pointing into the domain)
+ * @param[in]  vd   - drift velocity
+ * @param[in]  vth  - thermal velocity
+ * @param[in]  N    - number of velocities to be sampled
+ * @param[in]  rng  - random number generator
+ * @param[out] vs   - sampled velocities
+ *
+ * A velocity is drawn from the Maxwellian, and its normal component replaced
+ * by one drawn from the flux. The tangential components of an isotropic
+ * Gaussian are independent of the normal component.
+ */
+static void sample_maxwellian_flux(const std::vector<double> &n,
+                                   const std::vector<double> &vd,
+                                   double vth, std::size_t N,
+                                   RandomStream &rng, double *vs)
+{
+    std::normal_distribution<double> normal(0.0, 1.0);
+    std::uniform_real_distribution<double> rand(0.0, 1.0);
+
+    auto dim = n.size();
+    auto a = std::inner_product(n.begin(), n.end(), vd.begin(), 0.0) / vth;
+
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        auto v = &vs[i * dim];
+        double vn = 0.0;
+        for (std::size_t j = 0; j < dim; ++j)
+        {
+            v[j] = vd[j] + vth * normal(rng);
+            vn += v[j] * n[j];
+        }
+
+        auto vn_flux = vth * flux_normal_icdf(a, 1.0 - rand(rng));
+        for (std::size_t j = 0; j < dim; ++j)
+        {
+            v[j] += (vn_flux - vn) * n[j];
+        }
+    }
+}
+
+/**
+ * @brief Adds the drift velocity vd to N velocities vs
+ */
+static void add_drift(const std::vector<double> &vd, std::size_t N, double *vs)
+{
+    auto dim = vd.size();
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        for (std::size_t j = 0; j < dim; ++j)
+        {
+            vs[i * dim + j] += vd[j];
+        }
+    }
+}
+
+std::vector<long long> normal_key(const std::vector<double> &n)
+{
+    std::vector<long long> key;
+    for (auto &n_i : n)
+    {
+        key.push_back(std::llround(n_i * 1e9));
+    }
+    return key;
+}
+
+/**
+ * @brief Samples the Kappa-Cairns distribution or its flux without drift
+ * @param n     Normal vector for sampling the flux, or nullptr
+ * @param dim   Dimension
+ * @param vth   Thermal velocity
+ * @param k     Spectral index kappa, or 0 for the Cairns distribution
+ * @param alpha Spectral index alpha (non-negative)
+ * @param N     Number of velocities
+ * @param rng   Random number stream
+ * @param vs    Array of N sampled velocities
+ *
+ * The distribution of u=v/vth is a mixture of two isotropic components with
+ * masses \f[1\f] and \f[\alpha E[u^4]\f], where the second component is
+ * weighted by \f[u^4\f]. For the Cairns distribution, the squared speed of
+ * the components is chi-squared distributed with \f[D\f] and \f[D+4\f]
+ * degrees of freedom, respectively. For kappa>0, each component is
+ * furthermore a scale mixture where the velocity is scaled by
+ * \f[\sqrt{(2\kappa-D)/W}\f], and W is chi-squared distributed with
+ * \f[\nu=2\kappa+2-D\f] and \f[\nu-4\f] degrees of freedom, respectively.
+ *
+ * The flux is weighted by \f[u\f] in addition, which adds one degree of
+ * freedom to the squared speed, subtracts one from W, and makes the
+ * directions cosine-distributed about the normal. The latter is achieved by
+ * using the direction of a Maxwellian flux.
+ */
+static void sample_kappa_cairns(const std::vector<double> *n, int dim,
+                                double vth, double k, double alpha,
+                                std::size_t N, RandomStream &rng, double *vs)
+{
+    std::normal_distribution<double> normal(0.0, 1.0);
+    std::uniform_real_distribution<double> rand(0.0, 1.0);
+
+    double f = n ? 1.0 : 0.0;
+    double nu = 2 * k + 2 - dim;
+
+    // Logarithm of E[u^p] for the first component
+    auto log_moment = [&](double p) {
+        double res = 0.5 * p * log(2.0) + lgamma(0.5 * (dim + p)) - lgamma(0.5 * dim);
+        if (k > 0)
+        {
+            res += 0.5 * p * log(0.5 * (2 * k - dim)) +
+                   lgamma(0.5 * (nu - p)) - lgamma(0.5 * nu);
+        }
+        return res;
+    };
+
+    // Weight of the second component
+    double w = 0.0;
+    if (alpha > 0)
+    {
+        w = 1.0 / (1.0 + exp(log_moment(f) - log(alpha) - log_moment(4 + f)));
+    }
+
+    std::gamma_distribution<double> speed2(0.5 * (dim + 4 + f), 2.0);
+    std::gamma_distribution<double> inv_var[2] = {
+        std::gamma_distribution<double>(0.5 * (k > 0 ? nu - f : 1.0), 2.0),
+        std::gamma_distribution<double>(0.5 * (k > 0 && alpha > 0 ? nu - f - 4 : 1.0), 2.0)};
+
+    std::vector<double> zero(dim, 0.0);
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        auto v = &vs[i * dim];
+        if (n)
+        {
+            sample_maxwellian_flux(*n, zero, 1.0, 1, rng, v);
+        }
+        else
+        {
+            for (int j = 0; j < dim; ++j)
+            {
+                v[j] = normal(rng);
+            }
+        }
+
+        double scale = vth;
+        int c = rand(rng) < w;
+        if (c == 1)
+        {
+            double u2 = 0.0;
+            for (int j = 0; j < dim; ++j)
+            {
+                u2 += v[j] * v[j];
+            }
+            scale *= sqrt(speed2(rng) / u2);
+        }
+        if (k > 0)
+        {
+            scale *= sqrt((2 * k - dim) / inv_var[c](rng));
+        }
+
+        for (int j = 0; j < dim; ++j)
+        {
+            v[j] *= scale;
+        }
+    }
+}
+
 Maxwellian::Maxwellian(double vth, std::vector<double> &vd, bool has_icdf,
                        bool has_flux_num, bool has_flux_max, double vdf_range)
                       : Pdf(vth, vd, true, true, true, vdf_range)
 {
     vth2 = _vth * _vth;
     factor = (1.0 / (pow(sqrt(2. * M_PI * vth2), dim)));
+    has_flux_sampler = true;
 }
 
 double Maxwellian::operator()(const double *v)
@@ -38,13 +353,32 @@ double Maxwellian::operator()(const double *v)
     return factor * exp(-0.5 * v_sqrt / vth2);
 }
 
+void Maxwellian::evaluate(const double *vs, std::size_t N, double *out)
+{
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        double v2 = 0.0;
+        for (int j = 0; j < dim; ++j)
+        {
+            double dv = vs[i * dim + j] - _vd[j];
+            v2 += dv * dv;
+        }
+        out[i] = v2;
+    }
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        out[i] = factor * exp(-0.5 * out[i] / vth2);
+    }
+}
+
 void Maxwellian::icdf(double *vs, std::size_t N)
 {
-    for (auto j = 0; j < dim; ++j)
+    normal_icdf(vs, N * dim);
+    for (std::size_t i = 0; i < N; ++i)
     {
-        for (std::size_t i = 0; i < N; ++i)
+        for (auto j = 0; j < dim; ++j)
         {
-            vs[i * dim + j] = _vd[j] - sqrt(2.0) * _vth * boost::math::erfc_inv(2 * vs[i * dim + j]);
+            vs[i * dim + j] = _vd[j] + _vth * vs[i * dim + j];
         }
     }
 }
@@ -76,6 +410,12 @@ double Maxwellian::debye(double m, double q, double n, double eps0)
     return sqrt(eps0*m/(n*q*q))*_vth;
 }
 
+void Maxwellian::sample_flux(const std::vector<double> &n, std::size_t N,
+                             RandomStream &rng, double *vs)
+{
+    sample_maxwellian_flux(n, _vd, _vth, N, rng, vs);
+}
+
 Kappa::Kappa(double vth, std::vector<double> &vd, double k, bool has_icdf,
              bool has_flux_num, bool has_flux_max, double vdf_range)
             : Pdf(vth, vd, false, true, true, vdf_range), k(k)
@@ -95,6 +435,14 @@ Kappa::Kappa(double vth, std::vector<double> &vd, double k, bool has_icdf,
     vth2 = _vth * _vth;
     factor = (1.0 / pow(sqrt(M_PI * (2 * k - dim) * vth2), dim)) *
              (tgamma(k + 1.0) / tgamma(k + ((2.0-dim)/2.0)));
+
+    has_sampler = true;
+    update_samplers();
+}
+
+void Kappa::update_samplers()
+{
+    has_flux_sampler = drift_free();
 }
 
 double Kappa::operator()(const double *v)
@@ -107,6 +455,25 @@ double Kappa::operator()(const double *v)
     return factor * pow(1.0 + v2 / ((2 * k - dim) * vth2), -(k + 1.0));
 }
 
+void Kappa::evaluate(const double *vs, std::size_t N, double *out)
+{
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        double v2 = 0.0;
+        for (int j = 0; j < dim; ++j)
+        {
+            double dv = vs[i * dim + j] - _vd[j];
+            v2 += dv * dv;
+        }
+        out[i] = v2;
+    }
+    double a = 1.0 / ((2 * k - dim) * vth2);
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        out[i] = factor * exp(-(k + 1.0) * log1p(a * out[i]));
+    }
+}
+
 /* Number of particles for the case without any drift. */
 double Kappa::flux_num_particles(const std::vector<double> &n, double S)
 {
@@ -133,6 +500,18 @@ double Kappa::debye(double m, double q, double n, double eps0)
     return sqrt(eps0 * m / (n * q * q * B)) * _vth;
 }
 
+void Kappa::sample(std::size_t N, RandomStream &rng, double *vs)
+{
+    sample_kappa_cairns(nullptr, dim, _vth, k, 0.0, N, rng, vs);
+    add_drift(_vd, N, vs);
+}
+
+void Kappa::sample_flux(const std::vector<double> &n, std::size_t N,
+                        RandomStream &rng, double *vs)
+{
+    sample_kappa_cairns(&n, dim, _vth, k, 0.0, N, rng, vs);
+}
+
 Cairns::Cairns(double vth, std::vector<double> &vd, double alpha, bool has_icdf,
                bool has_flux_num, bool has_flux_max, double vdf_range)
               : Pdf(vth, vd, false, true, false, vdf_range), alpha(alpha)
@@ -140,6 +519,14 @@ Cairns::Cairns(double vth, std::vector<double> &vd, double alpha, bool has_icdf,
     vth2 = _vth * _vth;
     vth4 = vth2 * vth2;
     factor = (1.0 / (pow(sqrt(2 * M_PI * vth2), dim) * (1 + dim * (dim + 2) * alpha)));
+
+    has_sampler = alpha >= 0;
+    update_samplers();
+}
+
+void Cairns::update_samplers()
+{
+    has_flux_sampler = has_sampler && drift_free();
 }
 
 double Cairns::operator()(const double *v)
@@ -153,6 +540,25 @@ double Cairns::operator()(const double *v)
     return factor * (1 + alpha * v4 / vth4) * exp(-0.5 * v2 / vth2);
 }
 
+void Cairns::evaluate(const double *vs, std::size_t N, double *out)
+{
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        double v2 = 0.0;
+        for (int j = 0; j < dim; ++j)
+        {
+            double dv = vs[i * dim + j] - _vd[j];
+            v2 += dv * dv;
+        }
+        out[i] = v2;
+    }
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        double v2 = out[i];
+        out[i] = factor * (1 + alpha * v2 * v2 / vth4) * exp(-0.5 * v2 / vth2);
+    }
+}
+
 double Cairns::max()
 {
     if (alpha < 0.25)
@@ -192,6 +598,18 @@ double Cairns::debye(double m, double q, double n, double eps0)
     return sqrt(eps0 * m / (n * q * q * B)) * _vth;
 }
 
+void Cairns::sample(std::size_t N, RandomStream &rng, double *vs)
+{
+    sample_kappa_cairns(nullptr, dim, _vth, 0.0, alpha, N, rng, vs);
+    add_drift(_vd, N, vs);
+}
+
+void Cairns::sample_flux(const std::vector<double> &n, std::size_t N,
+                         RandomStream &rng, double *vs)
+{
+    sample_kappa_cairns(&n, dim, _vth, 0.0, alpha, N, rng, vs);
+}
+
 KappaCairns::KappaCairns(double vth, std::vector<double> &vd, double k,
                          double alpha, bool has_icdf, bool has_flux_num,
                          bool has_flux_max, double vdf_range)
@@ -204,6 +622,16 @@ KappaCairns::KappaCairns(double vth, std::vector<double> &vd, double k,
     factor = (1.0 / pow(sqrt(M_PI * (2. * k - dim) * vth2), dim)) *
              (1.0 / (1.0 + dim * (dim + 2.0) * alpha * ((k - dim/2.0) / (k - (dim+2)/2.0)))) *
              (tgamma(k + 1.0) / tgamma(k + ((2.0 - dim) / 2.0)));
+
+    // The second component requires finite moments of the inverse variance
+    has_sampler = alpha == 0 || (alpha > 0 && 2 * k - dim - 2 > 0);
+    update_samplers();
+}
+
+void KappaCairns::update_samplers()
+{
+    has_flux_sampler = (alpha == 0 || (alpha > 0 && 2 * k - dim - 3 > 0)) &&
+                       drift_free();
 }
 
 double KappaCairns::operator()(const double *v)
@@ -218,6 +646,27 @@ double KappaCairns::operator()(const double *v)
            pow(1.0 + v2 / ((2 * k - dim) * vth2), -(k + 1.0));
 }
 
+void KappaCairns::evaluate(const double *vs, std::size_t N, double *out)
+{
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        double v2 = 0.0;
+        for (int j = 0; j < dim; ++j)
+        {
+            double dv = vs[i * dim + j] - _vd[j];
+            v2 += dv * dv;
+        }
+        out[i] = v2;
+    }
+    double a = 1.0 / ((2 * k - dim) * vth2);
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        double v2 = out[i];
+        out[i] = factor * (1.0 + alpha * v2 * v2 / vth4) *
+                 exp(-(k + 1.0) * log1p(a * v2));
+    }
+}
+
 double KappaCairns::max()
 {
     double max;
@@ -244,4 +693,317 @@ double KappaCairns::debye(double m, double q, double n, double eps0)
     return sqrt(eps0 * m / (n * q * q * B)) * _vth;
 }
 
+void KappaCairns::sample(std::size_t N, RandomStream &rng, double *vs)
+{
+    sample_kappa_cairns(nullptr, dim, _vth, k, alpha, N, rng, vs);
+    add_drift(_vd, N, vs);
+}
+
+void KappaCairns::sample_flux(const std::vector<double> &n, std::size_t N,
+                              RandomStream &rng, double *vs)
+{
+    sample_kappa_cairns(&n, dim, _vth, k, alpha, N, rng, vs);
+}
+
+TabulatedPdf::TabulatedPdf(const std::string &fname)
+{
+    std::ifstream file(fname);
+    if (!file.good())
+    {
+        std::cerr << "Could not open velocity distribution " << fname << std::endl;
+        exit(1);
+    }
+
+    // Strip comments
+    std::stringstream content;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        auto start = line.find_first_not_of(" \t");
+        if (start != std::string::npos && line[start] == '#')
+        {
+            continue;
+        }
+        content << line << '\n';
+    }
+
+    content >> dim;
+    if (!content || dim < 1 || dim > 3)
+    {
+        std::cerr << fname << ": dimension must be 1, 2 or 3" << std::endl;
+        exit(1);
+    }
+
+    bins.resize(dim);
+    lower.resize(dim);
+    width.resize(dim);
+    std::size_t size = 1;
+    double bin_volume = 1.0;
+    for (int d = 0; d < dim; ++d)
+    {
+        double upper;
+        content >> bins[d] >> lower[d] >> upper;
+        if (!content || bins[d] == 0 || upper <= lower[d])
+        {
+            std::cerr << fname << ": invalid grid in dimension " << d << std::endl;
+            exit(1);
+        }
+        width[d] = (upper - lower[d]) / bins[d];
+        size *= bins[d];
+        bin_volume *= width[d];
+    }
+
+    values.resize(size);
+    for (auto &value : values)
+    {
+        content >> value;
+        if (!content || value < 0)
+        {
+            std::cerr << fname << ": expected " << size
+                      << " non-negative values" << std::endl;
+            exit(1);
+        }
+    }
+
+    auto sum = std::accumulate(values.begin(), values.end(), 0.0);
+    if (sum <= 0)
+    {
+        std::cerr << fname << ": the distribution is zero" << std::endl;
+        exit(1);
+    }
+    for (auto &value : values)
+    {
+        value /= sum * bin_volume;
+    }
+    value_max = *std::max_element(values.begin(), values.end());
+    alias = AliasTable(values);
+
+    // Drift and thermal velocity from the first and second moments
+    _vd.assign(dim, 0.0);
+    std::vector<double> v2(dim, 0.0);
+    std::vector<double> half(dim, 0.5);
+    double v[3];
+    for (std::size_t b = 0; b < size; ++b)
+    {
+        bin_point(b, half.data(), v);
+        for (int d = 0; d < dim; ++d)
+        {
+            _vd[d] += values[b] * bin_volume * v[d];
+            v2[d] += values[b] * bin_volume * v[d] * v[d];
+        }
+    }
+    double var = 0.0;
+    for (int d = 0; d < dim; ++d)
+    {
+        var += v2[d] - _vd[d] * _vd[d] + width[d] * width[d] / 12.0;
+    }
+    _vth = sqrt(var / dim);
+
+    has_icdf = false;
+    has_flux_number = true;
+    has_flux_max = true;
+    has_sampler = true;
+    has_flux_sampler = true;
+
+    domain.resize(2 * dim);
+    update_domain();
+    vdf_range = 0.0;
+    for (int d = 0; d < dim; ++d)
+    {
+        vdf_range = std::max(vdf_range, 0.5 * bins[d] * width[d] / _vth);
+    }
+}
+
+long TabulatedPdf::bin(const double *v) const
+{
+    long b = 0;
+    for (int d = 0; d < dim; ++d)
+    {
+        auto i = static_cast<long>(floor((v[d] - lower[d]) / width[d]));
+        if (i < 0 || i >= static_cast<long>(bins[d]))
+        {
+            return -1;
+        }
+        b = b * bins[d] + i;
+    }
+    return b;
+}
+
+void TabulatedPdf::bin_point(std::size_t b, const double *u, double *v) const
+{
+    for (int d = dim - 1; d >= 0; --d)
+    {
+        auto i = b % bins[d];
+        b /= bins[d];
+        v[d] = lower[d] + (i + u[d]) * width[d];
+    }
+}
+
+double TabulatedPdf::operator()(const double *v)
+{
+    auto b = bin(v);
+    return b < 0 ? 0.0 : values[b];
+}
+
+void TabulatedPdf::evaluate(const double *vs, std::size_t N, double *out)
+{
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        auto b = bin(&vs[i * dim]);
+        out[i] = b < 0 ? 0.0 : values[b];
+    }
+}
+
+void TabulatedPdf::update_domain()
+{
+    for (int d = 0; d < dim; ++d)
+    {
+        domain[d] = lower[d];
+        domain[d + dim] = lower[d] + bins[d] * width[d];
+    }
+}
+
+double TabulatedPdf::debye(double m, double q, double n, double eps0)
+{
+    return sqrt(eps0 * m / (n * q * q)) * _vth;
+}
+
+TabulatedPdf::FluxTable TabulatedPdf::build_flux_table(const std::vector<double> &n) const
+{
+    // Midpoint subgrid for bins intersected by the plane vn=0
+    const std::size_t sub = 8;
+    std::size_t num_sub = static_cast<std::size_t>(pow(sub, dim));
+
+    double bin_volume = 1.0;
+    double extent = 0.0;
+    for (int d = 0; d < dim; ++d)
+    {
+        bin_volume *= width[d];
+        extent += 0.5 * std::abs(n[d]) * width[d];
+    }
+
+    FluxTable table;
+    table.flux = 0.0;
+    table.max = 0.0;
+    std::vector<double> weights;
+    std::vector<double> half(dim, 0.5);
+    double v[3], u[3];
+    for (std::size_t b = 0; b < values.size(); ++b)
+    {
+        if (values[b] == 0.0)
+        {
+            continue;
+        }
+
+        bin_point(b, half.data(), v);
+        double vn_center = std::inner_product(v, v + dim, n.begin(), 0.0);
+        double vn_max = vn_center + extent;
+        if (vn_max <= 0.0)
+        {
+            continue;
+        }
+
+        // Mean of the positive part of vn in the bin
+        double vn_mean = vn_center;
+        if (vn_center - extent < 0.0)
+        {
+            vn_mean = 0.0;
+            for (std::size_t k = 0; k < num_sub; ++k)
+            {
+                auto k_ = k;
+                for (int d = 0; d < dim; ++d)
+                {
+                    u[d] = (k_ % sub + 0.5) / sub;
+                    k_ /= sub;
+                }
+                bin_point(b, u, v);
+                double vn = std::inner_product(v, v + dim, n.begin(), 0.0);
+                vn_mean += vn > 0.0 ? vn : 0.0;
+            }
+            vn_mean /= num_sub;
+        }
+
+        // Sampling a bin by the upper bound of the flux through it, and
+        // rejecting by vn/vn_max within it, is exact
+        table.bins.push_back(b);
+        table.vn_max.push_back(vn_max);
+        weights.push_back(values[b] * bin_volume * vn_max);
+        table.flux += values[b] * bin_volume * vn_mean;
+        table.max = std::max(table.max, values[b] * vn_max);
+    }
+    if (!weights.empty())
+    {
+        table.alias = AliasTable(weights);
+    }
+    return table;
+}
+
+const TabulatedPdf::FluxTable &TabulatedPdf::flux_table(const std::vector<double> &n) const
+{
+    auto it = flux_tables.find(normal_key(n));
+    if (it == flux_tables.end())
+    {
+        std::cerr << "TabulatedPdf: no flux table for the normal. "
+                  << "init_flux() must be called first." << std::endl;
+        exit(1);
+    }
+    return it->second;
+}
+
+void TabulatedPdf::init_flux(const std::vector<std::vector<double>> &normals)
+{
+    for (auto &n : normals)
+    {
+        auto key = normal_key(n);
+        if (!flux_tables.count(key))
+        {
+            flux_tables.emplace(key, build_flux_table(n));
+        }
+    }
+}
+
+double TabulatedPdf::flux_num_particles(const std::vector<double> &n, double S)
+{
+    return S * flux_table(n).flux;
+}
+
+double TabulatedPdf::flux_max(std::vector<double> &n)
+{
+    return flux_table(n).max;
+}
+
+void TabulatedPdf::sample(std::size_t N, RandomStream &rng, double *vs)
+{
+    std::vector<double> us(N * (dim + 1));
+    rng.uniform(us.data(), us.size());
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        auto u = &us[i * (dim + 1)];
+        bin_point(alias(u[0]), u + 1, &vs[i * dim]);
+    }
+}
+
+void TabulatedPdf::sample_flux(const std::vector<double> &n, std::size_t N,
+                               RandomStream &rng, double *vs)
+{
+    auto &table = flux_table(n);
+
+    double u[5];
+    for (std::size_t i = 0; i < N; ++i)
+    {
+        auto v = &vs[i * dim];
+        while (true)
+        {
+            rng.uniform(u, dim + 2);
+            auto k = table.alias(u[0]);
+            bin_point(table.bins[k], u + 1, v);
+            double vn = std::inner_product(v, v + dim, n.begin(), 0.0);
+            if (u[dim + 1] * table.vn_max[k] < vn)
+            {
+                break;
+            }
+        }
+    }
+}
+
 } // namespace punc
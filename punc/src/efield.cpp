@@ -25,6 +25,7 @@
 #include "../ufl/EField1D.h"
 #include "../ufl/EField2D.h"
 #include "../ufl/EField3D.h"
+#include "../ufl/EFieldOperator.h"
 #include "../ufl/Clement1D.h"
 #include "../ufl/Clement2D.h"
 #include "../ufl/Clement3D.h"
@@ -40,38 +41,85 @@ namespace punc
 
 ESolver::ESolver(const df::FunctionSpace &W,
                  std::string method, std::string preconditioner):
-                 solver(W.mesh()->mpi_comm(), method, preconditioner)
+                 W(std::make_shared<df::FunctionSpace>(W)),
+                 lumped(method == "lumped")
 {
     auto dim = W.mesh()->geometry().dim();
     auto W_shared = std::make_shared<df::FunctionSpace>(W);
     if (dim == 1)
     {
         a = std::make_shared<EField1D::BilinearForm>(W_shared, W_shared);
-        L = std::make_shared<EField1D::LinearForm>(W_shared);
     }
     else if (dim == 2)
     {
         a = std::make_shared<EField2D::BilinearForm>(W_shared, W_shared);
-        L = std::make_shared<EField2D::LinearForm>(W_shared);
     }
     else if (dim == 3)
     {
         a = std::make_shared<EField3D::BilinearForm>(W_shared, W_shared);
-        L = std::make_shared<EField3D::LinearForm>(W_shared);
     }
-    solver.parameters["absolute_tolerance"] = 1e-14;
-    solver.parameters["relative_tolerance"] = 1e-12;
-    solver.parameters["maximum_iterations"] = 1000;
-    solver.set_reuse_preconditioner(true);
 
     df::assemble(A, *a);
+
+    if (!lumped)
+    {
+        solver = std::make_shared<df::PETScKrylovSolver>(W.mesh()->mpi_comm(), method, preconditioner);
+        solver->parameters["absolute_tolerance"] = 1e-14;
+        solver->parameters["relative_tolerance"] = 1e-12;
+        solver->parameters["maximum_iterations"] = 1000;
+        solver->set_reuse_preconditioner(true);
+    }
+}
+
+void ESolver::init_operator(std::shared_ptr<const df::FunctionSpace> V_phi)
+{
+    V = V_phi;
+    auto dim = W->mesh()->geometry().dim();
+    std::shared_ptr<df::Form> g;
+    if (dim == 1)
+    {
+        g = std::make_shared<EFieldOperator::Form_0>(W, V);
+    }
+    else if (dim == 2)
+    {
+        g = std::make_shared<EFieldOperator::Form_1>(W, V);
+    }
+    else if (dim == 3)
+    {
+        g = std::make_shared<EFieldOperator::Form_2>(W, V);
+    }
+    df::assemble(G, *g);
+    G.init_vector(b, 0);
+
+    if (lumped)
+    {
+        // Scale each row of G by the inverse row sum of the mass matrix
+        df::PETScVector ones, M_lumped;
+        A.init_vector(ones, 1);
+        ones = 1.0;
+        A.init_vector(M_lumped, 0);
+        A.mult(ones, M_lumped);
+        VecReciprocal(M_lumped.vec());
+        MatDiagonalScale(G.mat(), M_lumped.vec(), NULL);
+    }
 }
 
 void ESolver::solve(df::Function &E, const df::Function &phi)
 {
-    L->set_coefficient("phi", std::make_shared<df::Function>(phi));
-    df::assemble(b, *L);
-    solver.solve(A, *E.vector(), b);
+    if (phi.function_space() != V)
+    {
+        init_operator(phi.function_space());
+    }
+
+    if (lumped)
+    {
+        G.mult(*phi.vector(), *E.vector());
+    }
+    else
+    {
+        G.mult(*phi.vector(), b);
+        solver->solve(A, *E.vector(), b);
+    }
 }
 
 EFieldDG0::EFieldDG0(const df::FunctionSpace &P)
@@ -0,0 +1,339 @@
+// Copyright (C) 2018, Diako Darian and Sigvald Marholm
+//
+// This file is part of PUNC++.
+//
+// PUNC++ is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// PUNC++ is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// PUNC++. If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ * @file		field_writer.cpp
+ * @brief		Asynchronous output of fields
+ */
+
+#include "../include/punc/field_writer.h"
+#include "../include/punc/profiler.h"
+#include <dolfin/common/MPI.h>
+#include <boost/filesystem.hpp>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace punc
+{
+
+/**
+ * @brief Encodes an array as inline binary VTK data
+ * @param   data    The array
+ * @param   bytes   Size of the array in bytes
+ * @return          Base64 encoding of the size (UInt32) followed by the array
+ */
+static std::string encode(const void *data, std::size_t bytes)
+{
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::vector<unsigned char> raw(4 + bytes);
+    auto size = static_cast<std::uint32_t>(bytes);
+    std::memcpy(raw.data(), &size, 4);
+    std::memcpy(raw.data() + 4, data, bytes);
+
+    std::string res;
+    res.reserve(4 * ((raw.size() + 2) / 3));
+    std::size_t i = 0;
+    for (; i + 2 < raw.size(); i += 3)
+    {
+        std::uint32_t x = (raw[i] << 16) | (raw[i + 1] << 8) | raw[i + 2];
+        res += table[(x >> 18) & 63];
+        res += table[(x >> 12) & 63];
+        res += table[(x >> 6) & 63];
+        res += table[x & 63];
+    }
+    if (i < raw.size())
+    {
+        std::uint32_t x = raw[i] << 16;
+        if (i + 1 < raw.size())
+        {
+            x |= raw[i + 1] << 8;
+        }
+        res += table[(x >> 18) & 63];
+        res += table[(x >> 12) & 63];
+        res += i + 1 < raw.size() ? table[(x >> 6) & 63] : '=';
+        res += '=';
+    }
+    return res;
+}
+
+FieldWriter::FieldWriter(std::shared_ptr<const df::Mesh> mesh,
+                         std::size_t buffers_per_file)
+    : mesh(mesh), active(df::MPI::size(mesh->mpi_comm()) == 1),
+      buffers_per_file(buffers_per_file)
+{
+    if (!active)
+    {
+        return;
+    }
+
+    // The mesh is the same for all snapshots, and is only encoded once
+    auto gdim = mesh->geometry().dim();
+    auto tdim = mesh->topology().dim();
+    auto num_vertices = mesh->num_vertices();
+    auto num_cells = mesh->num_cells();
+    auto vertices_per_cell = tdim + 1;
+
+    auto &coordinates = mesh->coordinates();
+    std::vector<double> points(3 * num_vertices, 0.0);
+    for (std::size_t v = 0; v < num_vertices; ++v)
+    {
+        for (std::size_t j = 0; j < gdim; ++j)
+        {
+            points[3 * v + j] = coordinates[gdim * v + j];
+        }
+    }
+
+    auto &cells = mesh->cells();
+    std::vector<std::uint32_t> connectivity(cells.begin(), cells.end());
+    std::vector<std::uint32_t> offsets(num_cells);
+    for (std::size_t c = 0; c < num_cells; ++c)
+    {
+        offsets[c] = (c + 1) * vertices_per_cell;
+    }
+
+    // VTK_VERTEX, VTK_LINE, VTK_TRIANGLE or VTK_TETRA
+    const std::uint8_t types[] = {1, 3, 5, 10};
+    std::vector<std::uint8_t> cell_types(num_cells, types[tdim]);
+
+    std::ostringstream oss;
+    oss << "<Piece NumberOfPoints=\"" << num_vertices
+        << "\" NumberOfCells=\"" << num_cells << "\">\n"
+        << "<Points>\n"
+        << "<DataArray type=\"Float64\" NumberOfComponents=\"3\" format=\"binary\">"
+        << encode(points.data(), points.size() * sizeof(double))
+        << "</DataArray>\n"
+        << "</Points>\n"
+        << "<Cells>\n"
+        << "<DataArray type=\"UInt32\" Name=\"connectivity\" format=\"binary\">"
+        << encode(connectivity.data(), connectivity.size() * sizeof(std::uint32_t))
+        << "</DataArray>\n"
+        << "<DataArray type=\"UInt32\" Name=\"offsets\" format=\"binary\">"
+        << encode(offsets.data(), offsets.size() * sizeof(std::uint32_t))
+        << "</DataArray>\n"
+        << "<DataArray type=\"UInt8\" Name=\"types\" format=\"binary\">"
+        << encode(cell_types.data(), cell_types.size())
+        << "</DataArray>\n"
+        << "</Cells>\n";
+    geometry = oss.str();
+
+    thread = std::thread(&FieldWriter::run, this);
+}
+
+FieldWriter::~FieldWriter()
+{
+    if (!active)
+    {
+        return;
+    }
+
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    changed.notify_all();
+    thread.join();
+}
+
+void FieldWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return pending == 0; });
+}
+
+std::unique_ptr<FieldWriter::Snapshot> FieldWriter::acquire()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (pending >= capacity)
+    {
+        // Backpressure: wait for the background thread to free a buffer
+        ProfilerScope scope("io wait");
+        changed.wait(lock, [this] { return pending < capacity; });
+    }
+    pending += 1;
+
+    if (pool.empty())
+    {
+        return std::unique_ptr<Snapshot>(new Snapshot);
+    }
+    auto snapshot = std::move(pool.back());
+    pool.pop_back();
+    return snapshot;
+}
+
+void FieldWriter::submit(std::unique_ptr<Snapshot> snapshot)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(snapshot));
+    }
+    changed.notify_all();
+}
+
+void FieldWriter::run()
+{
+    while (true)
+    {
+        std::unique_ptr<Snapshot> snapshot;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return stop || !queue.empty(); });
+            if (queue.empty())
+            {
+                return;
+            }
+            snapshot = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        write(*snapshot);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pool.push_back(std::move(snapshot));
+            pending -= 1;
+        }
+        changed.notify_all();
+    }
+}
+
+void FieldWriter::write(const Snapshot &snapshot)
+{
+    // Same naming as df::File, e.g. fields/phi000000.vtu
+    auto &collection = collections[snapshot.fname];
+    boost::filesystem::path pvd(snapshot.fname);
+    std::ostringstream vtu;
+    vtu << pvd.stem().string() << std::setw(6) << std::setfill('0')
+        << collection.size() << ".vtu";
+
+    const std::uint16_t one = 1;
+    bool little_endian = *reinterpret_cast<const char *>(&one) == 1;
+
+    auto fname = (pvd.parent_path() / vtu.str()).string();
+    std::ofstream file(fname);
+    if (!file.good())
+    {
+        std::cerr << "Could not write " << fname << std::endl;
+        return;
+    }
+
+    file << "<?xml version=\"1.0\"?>\n"
+         << "<VTKFile type=\"UnstructuredGrid\" version=\"0.1\" byte_order=\""
+         << (little_endian ? "LittleEndian" : "BigEndian") << "\">\n"
+         << "<UnstructuredGrid>\n"
+         << geometry
+         << "<PointData " << (snapshot.num_components == 1 ? "Scalars" : "Vectors")
+         << "=\"" << snapshot.name << "\">\n"
+         << "<DataArray type=\"Float64\" Name=\"" << snapshot.name
+         << "\" NumberOfComponents=\"" << snapshot.num_components
+         << "\" format=\"binary\">"
+         << encode(snapshot.values.data(), snapshot.values.size() * sizeof(double))
+         << "</DataArray>\n"
+         << "</PointData>\n"
+         << "</Piece>\n"
+         << "</UnstructuredGrid>\n"
+         << "</VTKFile>\n";
+    file.close();
+    if (!file)
+    {
+        std::cerr << "Could not write " << fname << std::endl;
+        return;
+    }
+
+    // Only list snapshots which were written
+    collection.emplace_back(snapshot.t, vtu.str());
+
+    // Rewrite the collection, such that it is complete if the run is killed
+    std::ofstream pvd_file(snapshot.fname);
+    pvd_file << "<?xml version=\"1.0\"?>\n"
+             << "<VTKFile type=\"Collection\" version=\"0.1\">\n"
+             << "  <Collection>\n"
+             << std::setprecision(16);
+    for (auto &entry : collection)
+    {
+        pvd_file << "    <DataSet timestep=\"" << entry.first
+                 << "\" part=\"0\" file=\"" << entry.second << "\" />\n";
+    }
+    pvd_file << "  </Collection>\n"
+             << "</VTKFile>\n";
+}
+
+FieldFile::FieldFile(FieldWriter &writer, const std::string &fname)
+    : writer(writer), fname(fname)
+{
+    if (!writer.active)
+    {
+        file.reset(new df::File(fname));
+        return;
+    }
+
+    auto dir = boost::filesystem::path(fname).parent_path();
+    if (!dir.empty())
+    {
+        boost::filesystem::create_directories(dir);
+    }
+
+    std::lock_guard<std::mutex> lock(writer.mutex);
+    writer.capacity += writer.buffers_per_file;
+}
+
+void FieldFile::write(const df::Function &f, double t)
+{
+    if (file)
+    {
+        file->write(f, t);
+        return;
+    }
+
+    auto rank = f.value_rank();
+    auto value_size = f.value_size();
+    if (rank > 1 || value_size > 3)
+    {
+        std::cerr << "Only scalar and vector fields can be written to "
+                  << fname << std::endl;
+        exit(1);
+    }
+
+    auto snapshot = writer.acquire();
+    snapshot->fname = fname;
+    snapshot->name = f.name();
+    snapshot->t = t;
+    snapshot->num_components = rank == 0 ? 1 : 3;
+
+    // Vertex values are ordered by component, while VTK interleaves them
+    f.compute_vertex_values(vertex_values, *writer.mesh);
+    auto num_vertices = writer.mesh->num_vertices();
+    auto num_components = snapshot->num_components;
+    snapshot->values.assign(num_components * num_vertices, 0.0);
+    for (std::size_t i = 0; i < value_size; ++i)
+    {
+        for (std::size_t v = 0; v < num_vertices; ++v)
+        {
+            snapshot->values[num_components * v + i] = vertex_values[i * num_vertices + v];
+        }
+    }
+
+    writer.submit(std::move(snapshot));
+}
+
+} // namespace punc
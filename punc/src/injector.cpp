@@ -17,68 +17,92 @@
 
 #include "../include/punc/injector.h"
 
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <numeric>
+#include <thread>
+
 namespace punc
 {
 
 typedef std::uniform_real_distribution<double> rand_uniform;
 
-void rejection_sampler(double *vs, std::size_t N,
-                       std::shared_ptr<Pdf> pdf,
-                       double pdf_max, int dim,
-                       const std::vector<double> &domain,
-                       rand_uniform &rand,
-                       std::mt19937_64 &rng)
+/**
+ * @brief Rejection sampling in blocks of candidates
+ *
+ * For each block, the candidates and the numbers deciding their acceptance
+ * are drawn at once, and the PDF is evaluated at all candidates by a single
+ * call to evaluate(xs, N, out).
+ */
+template <typename Evaluate>
+static void block_rejection_sampler(double *vs, std::size_t N, double pdf_max,
+                                    int dim, const std::vector<double> &domain,
+                                    RandomStream &rng, Evaluate evaluate)
 {
-    double tmp[dim];
+    const std::size_t block_size = 256;
+    std::vector<double> us(block_size * (dim + 1));
+    std::vector<double> xs(block_size * dim);
+    std::vector<double> values(block_size);
+
     std::size_t n = 0;
     while (n < N)
     {
-        for (int i = 0; i < dim; ++i)
+        // At least the remaining number of candidates are needed
+        auto size = std::min(block_size, N - n);
+
+        rng.uniform(us.data(), size * (dim + 1));
+        for (std::size_t b = 0; b < size; ++b)
         {
-            tmp[i] = domain[i] + (domain[i + dim] - domain[i]) * rand(rng);
+            for (int i = 0; i < dim; ++i)
+            {
+                xs[b * dim + i] = domain[i] + (domain[i + dim] - domain[i]) *
+                                              us[b * (dim + 1) + i];
+            }
         }
-        if (rand(rng) * pdf_max < (*pdf)(&tmp[0]))
+
+        evaluate(xs.data(), size, values.data());
+
+        for (std::size_t b = 0; b < size; ++b)
         {
-            for (int i = 0; i < dim; ++i)
+            if (us[b * (dim + 1) + dim] * pdf_max < values[b])
             {
-                vs[n * dim + i] = tmp[i];
+                std::copy(&xs[b * dim], &xs[(b + 1) * dim], &vs[n * dim]);
+                n += 1;
             }
-            n += 1;
         }
     }
 }
 
+void rejection_sampler(double *vs, std::size_t N,
+                       std::shared_ptr<Pdf> pdf,
+                       double pdf_max, int dim,
+                       const std::vector<double> &domain,
+                       RandomStream &rng)
+{
+    block_rejection_sampler(vs, N, pdf_max, dim, domain, rng,
+        [&](const double *xs, std::size_t M, double *out) {
+            pdf->evaluate(xs, M, out);
+        });
+}
+
 void rejection_sampler(double *vs, std::size_t N,
                        const std::vector<double> &n_vec,
                        std::shared_ptr<Pdf> pdf,
                        double pdf_max, int dim,
                        const std::vector<double> &domain,
-                       rand_uniform &rand,
-                       std::mt19937_64 &rng)
+                       RandomStream &rng)
 {
-    double tmp[dim];
-    std::size_t n = 0;
-    while (n < N)
-    {
-        for (int i = 0; i < dim; ++i)
-        {
-            tmp[i] = domain[i] + (domain[i + dim] - domain[i]) * rand(rng);
-        }
-        if (rand(rng) * pdf_max < (*pdf)(&tmp[0], n_vec))
-        {
-            for (int i = 0; i < dim; ++i)
-            {
-                vs[n * dim + i] = tmp[i];
-            }
-            n += 1;
-        }
-    }
+    block_rejection_sampler(vs, N, pdf_max, dim, domain, rng,
+        [&](const double *xs, std::size_t M, double *out) {
+            pdf->evaluate(xs, M, n_vec, out);
+        });
 }
 
 void random_facet_points(double *xs, std::size_t N,
                          const std::vector<double> &vertices,
                          rand_uniform &rand,
-                         std::mt19937_64 &rng)
+                         RandomStream &rng)
 {
     auto size = vertices.size();
     auto g_dim = static_cast<std::size_t>(sqrt(size));
@@ -101,72 +125,178 @@ void random_facet_points(double *xs, std::size_t N,
     }
 }
 
-void create_flux(std::vector<Species> &species, std::vector<ExteriorFacet> &facets)
+/**
+ * @brief Quasi-Monte Carlo integration of the flux PDF
+ * @param       pdf         The velocity distribution function
+ * @param       n           Normal vector of the facet
+ * @param       n_points    Number of integration points
+ * @param[out]  flux        Flux per unit area (per unit density)
+ * @param[out]  max         Maximum value of the flux PDF found
+ *
+ * The integration points in pdf.domain are taken from the R_d sequence of
+ * M. Roberts, which is a low-discrepancy Kronecker sequence based on the
+ * generalized golden ratio. Unlike other low-discrepancy sequences any point
+ * can be computed independently, and the points are divided between threads.
+ * The result is deterministic and independent of the number of threads.
+ */
+static void integrate_flux(Pdf &pdf, const std::vector<double> &n,
+                           std::size_t n_points, double &flux, double &max)
 {
-    rand_uniform rand(0.0, 1.0);
-    std::mt19937_64 rng(RandomSeed::get_instance());
+    auto dim = pdf.dim;
+    auto &domain = pdf.domain;
 
+    // Generalized golden ratio, i.e., the positive root of g^(dim+1) = g+1
+    double g = 2.0;
+    for (int k = 0; k < 50; ++k)
+    {
+        g = pow(1.0 + g, 1.0 / (dim + 1));
+    }
+    std::vector<double> alpha(dim);
+    for (int k = 0; k < dim; ++k)
+    {
+        alpha[k] = fmod(pow(1.0 / g, k + 1), 1.0);
+    }
+
+    // The points are divided into a fixed number of chunks, and the threads
+    // take every num_threads'th chunk. The chunks are summed in order, such
+    // that the result does not depend on the number of threads.
+    std::size_t num_chunks = 64;
+    std::vector<double> sums(num_chunks, 0.0), maxs(num_chunks, 0.0);
+
+    std::size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+    num_threads = std::min(num_threads, num_chunks);
+    std::vector<std::thread> threads;
+
+    for (std::size_t t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            const std::size_t block_size = 256;
+            std::vector<double> xs(block_size * dim), values(block_size);
+            for (std::size_t c = t; c < num_chunks; c += num_threads)
+            {
+                double local_sum = 0.0, local_max = 0.0;
+                auto begin = c * n_points / num_chunks;
+                auto end = (c + 1) * n_points / num_chunks;
+                for (std::size_t m0 = begin; m0 < end; m0 += block_size)
+                {
+                    auto size = std::min(block_size, end - m0);
+                    for (std::size_t b = 0; b < size; ++b)
+                    {
+                        for (int k = 0; k < dim; ++k)
+                        {
+                            double u = 0.5 + alpha[k] * (m0 + b);
+                            u -= floor(u);
+                            xs[b * dim + k] = domain[k] + u * (domain[k + dim] - domain[k]);
+                        }
+                    }
+                    pdf.evaluate(xs.data(), size, n, values.data());
+                    for (std::size_t b = 0; b < size; ++b)
+                    {
+                        local_sum += values[b];
+                        local_max = local_max > values[b] ? local_max : values[b];
+                    }
+                }
+                sums[c] = local_sum;
+                maxs[c] = local_max;
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    double volume = 1.0;
+    for (int k = 0; k < dim; k++)
+    {
+        volume *= domain[k + dim] - domain[k];
+    }
+
+    flux = volume * std::accumulate(sums.begin(), sums.end(), 0.0) / n_points;
+    max = *std::max_element(maxs.begin(), maxs.end());
+}
+
+void create_flux(std::vector<Species> &species, std::vector<ExteriorFacet> &facets,
+                 std::shared_ptr<SetupCache> cache)
+{
     auto num_species = species.size();
     auto num_facets = facets.size();
 
-    double pdf_x, volume, sum, max;
-    int n_iter = 500000;
-    
+    std::size_t n_points = 100000;
+
+    // Facets with the same normal (see normal_key()) share the flux per unit
+    // area and the maximum of the flux PDF. Typically there are only a few
+    // distinct normals, e.g., six for a box.
+    std::map<std::vector<long long>, std::size_t> normal_ids;
+    std::vector<std::size_t> facet_normal(num_facets);
+    std::vector<std::vector<double>> normals;
+    for (std::size_t j = 0; j < num_facets; ++j)
+    {
+        auto key = normal_key(facets[j].normal);
+        auto it = normal_ids.find(key);
+        if (it == normal_ids.end())
+        {
+            it = normal_ids.emplace(key, normals.size()).first;
+            normals.push_back(facets[j].normal);
+        }
+        facet_normal[j] = it->second;
+    }
+
     for (std::size_t i = 0; i < num_species; ++i)
     {
-        auto dim = species[i].vdf->dim;
-        auto domain = species[i].vdf->domain;
-        volume = 1.0;
-        for (int k = 0; k < dim; k++)
+        auto name = "flux." + std::to_string(i);
+        auto &vdf = *species[i].vdf;
+        vdf.init_flux(normals);
+
+        if (cache &&
+            cache->get(name + ".num_particles", vdf.num_particles) &&
+            cache->get(name + ".pdf_max", vdf.pdf_max) &&
+            vdf.num_particles.size() == num_facets &&
+            vdf.pdf_max.size() == num_facets)
         {
-            volume *= domain[k + dim] - domain[k];
+            continue;
+        }
+        vdf.num_particles.clear();
+        vdf.pdf_max.clear();
+
+        // Numerical flux and maximum for each distinct normal
+        std::vector<double> flux(normals.size()), max(normals.size());
+        if (!vdf.has_flux_number || !vdf.has_flux_max)
+        {
+            for (std::size_t u = 0; u < normals.size(); ++u)
+            {
+                integrate_flux(vdf, normals[u], n_points, flux[u], max[u]);
+            }
         }
 
         for (std::size_t j = 0; j < num_facets; ++j)
         {
-            if (species[i].vdf->has_flux_number)
+            auto u = facet_normal[j];
+
+            if (vdf.has_flux_number)
             {
-                auto num = species[i].vdf->flux_num_particles(facets[j].normal, facets[j].area);
-                species[i].vdf->num_particles.push_back(num);
+                vdf.num_particles.push_back(vdf.flux_num_particles(facets[j].normal, facets[j].area));
             }
             else
             {
-                sum = 0; 
-                double x[dim];
-                for (int n = 0; n < n_iter; ++n)
-                {
-                    for (int k = 0; k < dim; ++k)
-                    {
-                        x[k] = domain[k] + rand(rng) * (domain[k + dim] - domain[k]);
-                    }
-
-                    sum += (*species[i].vdf)(x, facets[j].normal);
-                }
-                auto num = facets[j].area*sum*volume/n_iter;
-                species[i].vdf->num_particles.push_back(num);
+                vdf.num_particles.push_back(facets[j].area * flux[u]);
             }
 
-            if (species[i].vdf->has_flux_max)
+            if (vdf.has_flux_max)
             {
-                species[i].vdf->pdf_max.push_back(species[i].vdf->flux_max(facets[j].normal));
+                vdf.pdf_max.push_back(vdf.flux_max(facets[j].normal));
             }
             else
             {
-                max = 0;
-                double x[dim];
-                for (int n = 0; n < n_iter; ++n)
-                {
-                    for (int k = 0; k < dim; ++k)
-                    {
-                        x[k] = domain[k] + rand(rng) * (domain[k + dim] - domain[k]);
-                    }
-
-                    pdf_x = (*species[i].vdf)(x, facets[j].normal);
-                    max = max > pdf_x ? max : pdf_x;
-                }
-                species[i].vdf->pdf_max.push_back(max*1.01);
+                vdf.pdf_max.push_back(max[u] * 1.01);
             }
         }
+
+        if (cache)
+        {
+            cache->set(name + ".num_particles", vdf.num_particles);
+            cache->set(name + ".pdf_max", vdf.pdf_max);
+        }
     }
 }
 
@@ -30,6 +30,7 @@
 
 #include <string>
 #include <boost/filesystem.hpp>
+#include <boost/functional/hash.hpp>
 
 #include "../ufl/Volume.h"
 #include "../ufl/Surface.h"
@@ -231,10 +232,24 @@ void Mesh::exterior_boundaries()
             basis[5] = normal[2] * vertex[0] - normal[0] * vertex[2];
             basis[8] = normal[0] * vertex[1] - normal[1] * vertex[0];
         }
-        exterior_facets.push_back(ExteriorFacet{area, vertices, normal, basis});
+        exterior_facets.push_back(ExteriorFacet{area, vertices, normal, basis,
+                                                cell.index()});
     }
 }
 
+std::size_t Mesh::hash() const
+{
+    std::size_t seed = 0;
+    auto &coordinates = mesh->coordinates();
+    auto &cells = mesh->cells();
+    auto values = bnd.values();
+    boost::hash_combine(seed, dim);
+    boost::hash_range(seed, coordinates.begin(), coordinates.end());
+    boost::hash_range(seed, cells.begin(), cells.end());
+    boost::hash_range(seed, values, values + bnd.size());
+    return seed;
+}
+
 double surface_area(Mesh &mesh, std::size_t bnd_id)
 {
     auto dim = mesh.dim;
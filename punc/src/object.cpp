@@ -21,8 +21,13 @@
  */
 
 #include "../include/punc/object.h"
+#include <dolfin/fem/assemble.h>
+#include <dolfin/la/PETScVector.h>
+#include <dolfin/common/MPI.h>
 #include <vector>
 
+#include "../ufl/ChargeVector.h"
+
 namespace punc
 {
 
@@ -65,6 +70,64 @@ Circuit::Circuit(const ObjectVector &object_vector,
 
 }
 
+SparseFunctional::SparseFunctional(const df::GenericVector &w)
+                                  : comm(w.mpi_comm())
+{
+    std::vector<double> w_local;
+    w.get_local(w_local);
+    for (std::size_t i = 0; i < w_local.size(); ++i)
+    {
+        if (w_local[i] != 0.0)
+        {
+            dofs.emplace_back(i);
+            weights.emplace_back(w_local[i]);
+        }
+    }
+    values.resize(dofs.size());
+}
+
+double SparseFunctional::operator()(const df::GenericVector &x) const
+{
+    x.get_local(values.data(), dofs.size(), dofs.data());
+    double result = 0;
+    for (std::size_t i = 0; i < dofs.size(); ++i)
+    {
+        result += weights[i] * values[i];
+    }
+    return df::MPI::sum(comm, result);
+}
+
+SparseFunctional charge_functional(const df::FunctionSpace &V,
+                                   const Mesh &mesh,
+                                   std::size_t bnd_id,
+                                   double eps0)
+{
+    auto V_shared = std::make_shared<df::FunctionSpace>(V);
+    std::shared_ptr<df::Form> charge;
+    if (mesh.dim == 1)
+    {
+        charge = std::make_shared<ChargeVector::Form_0>(V_shared);
+    }
+    else if (mesh.dim == 2)
+    {
+        charge = std::make_shared<ChargeVector::Form_1>(V_shared);
+    }
+    else if (mesh.dim == 3)
+    {
+        charge = std::make_shared<ChargeVector::Form_2>(V_shared);
+    }
+
+    auto bnd = std::make_shared<df::MeshFunction<std::size_t>>(mesh.bnd);
+    relabel_mesh_function(*bnd, bnd_id, 9999);
+    charge->set_exterior_facet_domains(bnd);
+
+    df::PETScVector weights;
+    df::assemble(weights, *charge);
+    weights *= eps0;
+
+    return SparseFunctional(weights);
+}
+
 std::ostream& operator<<(std::ostream& out, const VSource &s){
     return out << "V_{" << s.node_a << ", " << s.node_b << "} = " << s.value;
 }
@@ -26,7 +26,6 @@
  */
 
 #include "../include/punc/object_BC.h"
-#include "../ufl/Charge.h"
 #include "../ufl/Constraint.h"
 #include <dolfin/function/Constant.h>
 #include <dolfin/fem/assemble.h>
@@ -36,6 +35,7 @@
 #include <dolfin/la/SparsityPattern.h>
 #include <dolfin/la/GenericLinearAlgebraFactory.h>
 #include <dolfin/common/MPI.h>
+#include <map>
 
 namespace punc {
 
@@ -43,25 +43,27 @@ namespace punc {
  * LOCAL DECLARATIONS
  ******************************************************************************/
 
+//! Replacement rows. Maps row index to columns and values.
+using RowMap = std::map<std::size_t, std::pair<std::vector<std::size_t>,
+                                               std::vector<double>>>;
+
 /**
- * @brief Replace a row in a matrix
+ * @brief Replace rows in a matrix
  * @param       A       Input matrix
  * @param[out]  Bc      Output matrix
- * @param       row     Which row to place values in
- * @param       cols    Which columns to place values in
- * @param       vals    Values, one for each column in cols
+ * @param       rows    Rows to replace, and their columns and values
  * @param       V       Function Space
  *
  * Since the sparsity pattern in a PETSc matrix cannot be changed after it is
  * made, one has to make an entirely new matrix when violating the original
- * sparsity pattern. cols is the new sparsity pattern for the row to be
- * replaced. Columns not in cols will be zero.
+ * sparsity pattern. The columns of each row in rows is the new sparsity
+ * pattern for that row. Columns not given will be zero. All rows are replaced
+ * in one pass, such that the combined sparsity pattern is computed and the
+ * new matrix preallocated and filled only once.
  */
-static void addrow(const df::GenericMatrix& A, df::GenericMatrix& Bc,
-                   std::size_t row,
-                   const std::vector<std::size_t> &cols,
-                   const std::vector<double> &vals,
-                   const df::FunctionSpace& V);
+static void addrows(const df::GenericMatrix& A, df::GenericMatrix& Bc,
+                    const RowMap &rows,
+                    const df::FunctionSpace& V);
 
 /*******************************************************************************
  * GLOBAL DEFINITIONS
@@ -75,61 +77,59 @@ void ObjectBC::apply(df::GenericVector &b)
     b.setitem(first_ind, first_element);
 }
 
+bool ObjectBC::vector_dofs(std::vector<df::la_index> &dofs,
+                           bool &potential) const
+{
+    // Same as apply(b): all but the first dof are zeroed
+    dofs.assign(this->dofs.begin() + 1, this->dofs.end());
+    potential = false;
+    return true;
+}
+
 void ObjectBC::apply(df::GenericMatrix &A)
 {
-    std::vector<std::size_t> neighbors;
+    // All rows but the first are replaced by the constraint that the
+    // potential equals the mean of its neighbours on the object surface.
+    // These neighbours are already in the sparsity pattern of A, so the rows
+    // can be overwritten in place. The new rows are stored contiguously
+    // (row i has the entries from offsets[i] to offsets[i+1]).
+    std::vector<df::la_index> rows(dofs.begin() + 1, dofs.end());
+    std::vector<df::la_index> surface(dofs.begin(), dofs.end());
+    std::sort(surface.begin(), surface.end());
+
+    std::vector<std::size_t> offsets(1, 0);
+    std::vector<df::la_index> columns;
     std::vector<double> values;
-    std::vector<std::size_t> surface_neighbors;
-    std::vector<df::la_index> zero_row;
-    std::size_t self_index = 0;
-    std::vector<df::la_index> ind;
-    std::vector<std::vector<std::size_t> > allneighbors;
-
-    for (std::size_t i = 0; i < num_dofs; i++)
-        ind.push_back(dofs[i]);
-
-    std::sort (ind.begin(), ind.end(), [](int i, int j) { return (i<j);} );
+    std::vector<std::size_t> neighbors;
+    std::vector<double> row_values;
 
-    for (std::size_t i = 0; i < ind.size(); i++)
+    for (auto row : rows)
     {
-      if (ind[i] == dofs[0])
-        continue;
-      std::size_t row = ind[i];
-      A.getrow(row, neighbors, values);
-      allneighbors.push_back(neighbors);
+        A.getrow(row, neighbors, row_values);
+        std::size_t first = columns.size();
+        std::size_t self = first;
+        for (auto neighbor : neighbors)
+        {
+            df::la_index n = neighbor;
+            if (std::binary_search(surface.begin(), surface.end(), n))
+            {
+                if (n == row) self = columns.size();
+                columns.push_back(n);
+                values.push_back(-1.0);
+            }
+        }
+        if (columns.size() > first)
+        {
+            values[self] = columns.size() - first - 1;
+        }
+        offsets.push_back(columns.size());
     }
-    A.zero(dofs.size()-1, dofs.data()+1);
 
-    std::size_t count = 0;
-    for (std::size_t i = 0; i < ind.size(); i++)
+    A.zero(rows.size(), rows.data());
+    for (std::size_t i = 0; i < rows.size(); ++i)
     {
-      if (ind[i] == dofs[0])
-        continue;
-
-      std::size_t row = ind[i];
-      surface_neighbors.clear();
-      values.clear();
-      for (std::size_t j = 0; j < allneighbors[count].size(); j++)
-      {
-         std::size_t n = allneighbors[count][j];
-         if (std::binary_search(ind.begin(), ind.end(), n))
-         {
-           surface_neighbors.push_back(n);
-           values.push_back(-1.0);
-         }
-      }
-      for (std::size_t j = 0; j < surface_neighbors.size(); j++)
-      {
-        if (surface_neighbors[j] == row)
-        {
-          self_index = j;
-          break;
-        }
-      }
-      std::size_t num_of_neighbors = surface_neighbors.size()-1;
-      values[self_index] = num_of_neighbors;
-      A.setrow(row, surface_neighbors, values);
-      count++;
+        A.set(&values[offsets[i]], 1, &rows[i],
+              offsets[i + 1] - offsets[i], &columns[offsets[i]]);
     }
     A.apply("insert");
 }
@@ -172,37 +172,20 @@ ObjectBC::ObjectBC(const df::FunctionSpace &V,
         }
     }
 
-    auto eps0_ = std::make_shared<df::Constant>(eps0);
-
-    if (mesh.dim == 1)
-    {
-        charge_form = std::make_shared<Charge::Form_0>(mesh.mesh);
-        charge_form->set_coefficient("w0", eps0_);
-    }
-    else if (mesh.dim == 2)
-    {
-        charge_form = std::make_shared<Charge::Form_1>(mesh.mesh);
-        charge_form->set_coefficient("w0", eps0_);
-    }
-    else if (mesh.dim == 3)
-    {
-        charge_form = std::make_shared<Charge::Form_2>(mesh.mesh);
-        charge_form->set_coefficient("eps0", eps0_);
-    }
-    charge_form->set_exterior_facet_domains(std::make_shared<df::MeshFunction<std::size_t>>(bnd));
+    charge_weights = std::make_shared<SparseFunctional>(
+        punc::charge_functional(V, mesh, bnd_id, eps0));
 }
 
 void ObjectBC::update(const df::Function &phi)
 {
+    auto phi_vec = phi.vector();
+
     // update charge
-    charge_form->set_coefficient("w1", std::make_shared<df::Function>(phi));
-    charge = df::assemble(*charge_form);
+    charge = (*charge_weights)(*phi_vec);
 
     // update potential
-    std::vector<double> phi_array(num_dofs, 0.0);
-    auto phi_vec = phi.vector();
-    phi_vec->get_local(phi_array);
-    potential = phi_array[get_free_row()];
+    auto row = get_free_row();
+    phi_vec->get_local(&potential, 1, &row);
 }
 
 CircuitBC::CircuitBC(const df::FunctionSpace &V,
@@ -308,7 +291,9 @@ void CircuitBC::apply(df::PETScMatrix &A)
         charge_constr = std::make_shared<Constraint::Form_2>(V1, V0, eps0_);
     }
 
-    df::PETScMatrix A_tmp;
+    // The constraint rows are collected such that the matrix only has to be
+    // rebuilt once
+    RowMap rows;
 
     // Charge constraints
     for (std::size_t i = 0; i < groups.size(); ++i)
@@ -320,17 +305,8 @@ void CircuitBC::apply(df::PETScMatrix &A)
         df::PETScMatrix A_constraint; // Only one row
         df::assemble(A_constraint, *charge_constr);
 
-        std::vector<std::size_t> cols;
-        std::vector<double> vals;
-        A_constraint.getrow(0, cols, vals);
-
-        addrow(A, A_tmp, rows_charge[i], cols, vals, V);
-        auto Amat = A.mat();
-        PetscErrorCode ierr = MatDuplicate(A_tmp.mat(), MAT_COPY_VALUES, &Amat);
-        if (ierr != 0)
-        {
-            std::cout << "Error in PETSc MatDuplicate: " << ierr << '\n';
-        }
+        auto &row = rows[rows_charge[i]];
+        A_constraint.getrow(0, row.first, row.second);
     }
 
     // Potential constraints
@@ -338,8 +314,9 @@ void CircuitBC::apply(df::PETScMatrix &A)
     {
         auto obj_a_id = vsources[i].node_a;
         auto obj_b_id = vsources[i].node_b;
-        std::vector<std::size_t> cols;
-        std::vector<double> vals;
+        auto &row = rows[rows_potential[i]];
+        auto &cols = row.first;
+        auto &vals = row.second;
 
         if (obj_a_id != -1)
         {
@@ -354,22 +331,13 @@ void CircuitBC::apply(df::PETScMatrix &A)
             cols.emplace_back(dof_b);
             vals.emplace_back(1.0);
         }
-        addrow(A, A_tmp, rows_potential[i], cols, vals, V);
-        auto Amat = A.mat();
-        PetscErrorCode ierr = MatDuplicate(A_tmp.mat(), MAT_COPY_VALUES, &Amat);
-        if (ierr != 0)
-        {
-            std::cout << "Error in PETSc MatDuplicate: " << ierr << '\n';
-        }
     }
 
-    MatSetOption(A.mat(), MAT_NEW_NONZERO_LOCATIONS, PETSC_TRUE); 
-    PetscErrorCode ierr = MatCopy(A_tmp.mat(), A.mat(), DIFFERENT_NONZERO_PATTERN);
-    if (ierr != 0)
-    {
-        std::cout << "Error in PETSc MatCopy: " << ierr << '\n';
-    }
-    MatSetOption(A.mat(), MAT_NEW_NONZERO_LOCATIONS, PETSC_FALSE); 
+    if (rows.empty()) return;
+
+    df::PETScMatrix A_tmp;
+    addrows(A, A_tmp, rows, V);
+    A = A_tmp;
 }
 
 void CircuitBC::apply_vsources_to_vector(df::GenericVector &b)
@@ -418,11 +386,9 @@ void CircuitBC::apply_isources_to_object()
  * LOCAL DEFINITIONS
  ******************************************************************************/
 
-static void addrow(const df::GenericMatrix& A, df::GenericMatrix& Bc,
-                   std::size_t row,
-                   const std::vector<std::size_t> &cols,
-                   const std::vector<double> &vals,
-                   const df::FunctionSpace& V)
+static void addrows(const df::GenericMatrix& A, df::GenericMatrix& Bc,
+                    const RowMap &rows,
+                    const df::FunctionSpace& V)
 {
     std::shared_ptr<df::TensorLayout> layout;
     std::vector<const df::GenericDofMap *> dofmaps;
@@ -483,12 +449,13 @@ static void addrow(const df::GenericMatrix& A, df::GenericMatrix& Bc,
         global_dofs[1].clear();
         columns.clear();
         values.clear();
-        if (global_row == row)
+        auto replacement = rows.find(global_row);
+        if (replacement != rows.end())
         {
             if (df::MPI::rank(mesh.mpi_comm()) == 0)
             {
-                columns = cols;
-                values = vals;
+                columns = replacement->second.first;
+                values = replacement->second.second;
             }
         }
         else
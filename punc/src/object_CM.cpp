@@ -21,16 +21,21 @@
  *
  * Solves a particular solution of the equation with zero Dirichlet boundary
  * conditions, and then computes the mirror charge this leads to on the
- * objects, and uses this to compute the correct potential. A second solution
- * with the correct Dirichlet boundary conditions yields the correct solution.
- * Same method as described in PTetra paper.
+ * objects, and uses this to compute the correct potential. The correct
+ * solution is obtained by adding the Laplace solution of each object scaled
+ * by its potential, which is equivalent to a second solution with the correct
+ * Dirichlet boundary conditions. Same method as described in PTetra paper.
  */
 
 #include "../include/punc/object_CM.h"
 #include "../include/punc/poisson.h"
-#include "../ufl/Charge.h"
+#include "../include/punc/setup_cache.h"
 #include <dolfin/function/Constant.h>
 #include <dolfin/fem/assemble.h>
+#include <dolfin/common/MPI.h>
+#include <boost/functional/hash.hpp>
+#include <fstream>
+#include <cstdint>
 
 namespace punc {
 
@@ -40,10 +45,42 @@ namespace punc {
 
 bool inv(const boost_matrix &mat, boost_matrix &inv_mat);
 
+/*******************************************************************************
+ * LOCAL DECLARATIONS
+ ******************************************************************************/
 
-std::vector<df::Function> laplace_solver(const df::FunctionSpace &V,
-                                         std::vector<std::shared_ptr<Object>> &objects,
-                                         Mesh &mesh, double eps0);
+/**
+ * @brief Key identifying a capacitance cache file
+ * @param   V           Function space
+ * @param   objects     Objects
+ * @param   mesh        The mesh
+ * @return              Hash of the mesh, dof numbering and object ids
+ */
+static std::size_t capacitance_key(const df::FunctionSpace &V,
+                                   const ObjectVector &objects,
+                                   const Mesh &mesh);
+
+/**
+ * @brief Loads Laplace solutions and inverse capacitance matrix from file
+ * @param       fname               File name
+ * @param       key                 Expected key, see capacitance_key()
+ * @param       V                   Function space
+ * @param[out]  laplace_solutions   Laplace solutions
+ * @param[out]  inv_capacity        Inverse capacitance matrix
+ * @return                          False if the file is missing or invalid
+ */
+static bool load_capacitance(const std::string &fname, std::size_t key,
+                             const df::FunctionSpace &V,
+                             std::vector<df::Function> &laplace_solutions,
+                             boost_matrix &inv_capacity);
+
+/**
+ * @brief Saves Laplace solutions and inverse capacitance matrix to file
+ * @see load_capacitance
+ */
+static void save_capacitance(const std::string &fname, std::size_t key,
+                             const std::vector<df::Function> &laplace_solutions,
+                             const boost_matrix &inv_capacity);
 
 
 /*******************************************************************************
@@ -64,41 +101,31 @@ boost_matrix inv_capacitance(const df::FunctionSpace &V,
                              Mesh &mesh,
                              double eps0)
 {
-    auto dim = mesh.dim;
-    auto num_objects = objects.size();
+    auto phi_vec = laplace_solver(V, objects, mesh, eps0);
+    return inv_capacitance(phi_vec, mesh, eps0);
+}
 
-    std::shared_ptr<df::Form> charge;
-    auto _eps0 = std::make_shared<df::Constant>(eps0);
-    if (dim == 1)
-    {
-        charge = std::make_shared<Charge::Form_0>(mesh.mesh);
-        charge->set_coefficient("w0", _eps0);
-    }
-    else if (dim == 2)
-    {
-        charge = std::make_shared<Charge::Form_1>(mesh.mesh);
-        charge->set_coefficient("w0", _eps0);
-    }
-    else if (dim == 3)
-    {
-        charge = std::make_shared<Charge::Form_2>(mesh.mesh);
-        charge->set_coefficient("eps0", _eps0);
-    }
+boost_matrix inv_capacitance(const std::vector<df::Function> &phi_vec,
+                             Mesh &mesh,
+                             double eps0)
+{
+    auto num_objects = phi_vec.size();
 
     boost_matrix capacitance(num_objects, num_objects);
     boost_matrix inv_capacity(num_objects, num_objects);
 
-    auto phi_vec = laplace_solver(V, objects, mesh, eps0);
+    if (num_objects == 0) return inv_capacity;
+
+    // The charge is linear in phi, so one functional per object replaces
+    // num_objects^2 surface assemblies by sparse inner products.
+    auto &V = *phi_vec[0].function_space();
     for (std::size_t i = 0; i < num_objects; ++i)
     {
-        relabel_mesh_function(mesh.bnd, i + 2, 9999);
-        charge->set_exterior_facet_domains(std::make_shared<df::MeshFunction<std::size_t>>(mesh.bnd));
+        auto charge = charge_functional(V, mesh, i + 2, eps0);
         for (std::size_t j = 0; j < num_objects; ++j)
         {
-            charge->set_coefficient("w1", std::make_shared<df::Function>(phi_vec[j]));
-            capacitance(i, j) = df::assemble(*charge);
+            capacitance(i, j) = charge(*phi_vec[j].vector());
         }
-        relabel_mesh_function(mesh.bnd, 9999, i + 2);
     }
 
     inv(capacitance, inv_capacity);
@@ -127,6 +154,21 @@ void ObjectCM::apply(df::GenericVector &b)
     df::DirichletBC::apply(b);
 }
 
+bool ObjectCM::vector_dofs(std::vector<df::la_index> &dofs,
+                           bool &potential) const
+{
+    Map dof_map;
+    get_boundary_values(dof_map);
+
+    dofs.clear();
+    for (auto &dof : dof_map)
+    {
+        dofs.emplace_back(dof.first);
+    }
+    potential = true;
+    return true;
+}
+
 void ObjectCM::apply(df::GenericMatrix &A)
 {
     df::DirichletBC::apply(A);
@@ -137,16 +179,37 @@ CircuitCM::CircuitCM(const df::FunctionSpace &V,
                      const VSourceVector &vsources,
                      const ISourceVector &isources,
                      Mesh &mesh,
-                     double dt, double eps0)
+                     double dt, double eps0,
+                     const std::string &cache_fname)
                     : Circuit(object_vector, vsources, isources),
                       dt(dt), eps0(eps0)
 {
     correction_required = true;
 
-    inv_circuit_mat.resize(2 * object_vector.size(), 2 * object_vector.size(), 0.0);
-    circuit_vector.resize(2 * object_vector.size());
+    circuit_vector = Eigen::VectorXd::Zero(2 * object_vector.size());
+
+    // The dof numbering is only reproducible in serial
+    bool use_cache = cache_fname != "" &&
+                     df::MPI::size(mesh.mesh->mpi_comm()) == 1;
+    std::size_t key = 0;
+    if (use_cache) key = capacitance_key(V, object_vector, mesh);
 
-    inv_capacitance_mat = inv_capacitance(V, object_vector, mesh);
+    // Laplace solutions are kept for correcting the potential by
+    // superposition in correct()
+    if (use_cache && load_capacitance(cache_fname, key, V, laplace_solutions,
+                                      inv_capacitance_mat))
+    {
+        std::cout << "  Capacitance matrix loaded from " << cache_fname << std::endl;
+    }
+    else
+    {
+        laplace_solutions = laplace_solver(V, object_vector, mesh);
+        inv_capacitance_mat = inv_capacitance(laplace_solutions, mesh);
+        if (use_cache)
+        {
+            save_capacitance(cache_fname, key, laplace_solutions, inv_capacitance_mat);
+        }
+    }
 
     downcast_objects(object_vector);
 
@@ -177,22 +240,9 @@ CircuitCM::CircuitCM(const df::FunctionSpace &V,
 
     assemble_matrix();
 
-    auto _eps0 = std::make_shared<df::Constant>(eps0);
-    auto dim = mesh.dim;
-    if (dim == 1)
-    {
-        image_charge = std::make_shared<Charge::Form_0>(mesh.mesh);
-        image_charge->set_coefficient("w0", _eps0);
-    }
-    else if (dim == 2)
-    {
-        image_charge = std::make_shared<Charge::Form_1>(mesh.mesh);
-        image_charge->set_coefficient("w0", _eps0);
-    }
-    else if (dim == 3)
+    for (std::size_t j = 0; j < num_objects; ++j)
     {
-        image_charge = std::make_shared<Charge::Form_2>(mesh.mesh);
-        image_charge->set_coefficient("eps0", _eps0);
+        image_charge.emplace_back(charge_functional(V, mesh, j + 2, eps0));
     }
 }
 
@@ -220,7 +270,7 @@ bool CircuitCM::check_solver_methods(std::string &method,
 
 void CircuitCM::assemble_matrix()
 {
-    boost_matrix circuit_matrix(2*num_objects, 2*num_objects, 0.0);
+    Eigen::MatrixXd circuit_matrix = Eigen::MatrixXd::Zero(2*num_objects, 2*num_objects);
 
     // Potential constaints
     for (std::size_t i = 0; i < vsources.size(); ++i)
@@ -269,7 +319,9 @@ void CircuitCM::assemble_matrix()
         }
     }
 
-    inv(circuit_matrix, inv_circuit_mat);
+    // Factorized once, such that each time-step only requires a forward and
+    // backward substitution rather than a multiplication with the inverse.
+    circuit_lu.compute(circuit_matrix);
 }
 
 void CircuitCM::assemble_vector()
@@ -327,33 +379,38 @@ void CircuitCM::assemble_vector()
 
 void CircuitCM::post_solve(const df::Function &phi, Mesh &mesh)
 {
+    auto phi_vec = phi.vector();
     for (std::size_t j = 0; j < num_objects; ++j)
     {
-        relabel_mesh_function(mesh.bnd, j + 2, 9999);
-        image_charge->set_exterior_facet_domains(std::make_shared<df::MeshFunction<std::size_t>>(mesh.bnd));
-        image_charge->set_coefficient("w1", std::make_shared<df::Function>(phi));
-        objects[j]->image_charge = df::assemble(*image_charge);
-        relabel_mesh_function(mesh.bnd, 9999, j + 2);
+        objects[j]->image_charge = image_charge[j](*phi_vec);
     }
 
     assemble_vector();
 
-    double potential, charge;
+    // Potentials followed by charges
+    Eigen::VectorXd solution = circuit_lu.solve(circuit_vector);
     for (std::size_t i = 0; i < num_objects; ++i)
     {
-        potential = 0.0;
-        charge = 0.0;
-        for (std::size_t j = 0; j < 2*num_objects; ++j)
-        {
-            potential += inv_circuit_mat(i,j) * circuit_vector[j];
-        }
-        for (std::size_t j = 0; j < 2 * num_objects; ++j)
+        objects[i]->set_potential(solution[i]);
+        objects[i]->charge = solution[num_objects + i];
+    }
+}
+
+bool CircuitCM::correct(df::Function &phi)
+{
+    // The potential was solved with zero potential on all objects. Since
+    // the problem is linear, adding each object's Laplace solution scaled by
+    // its correct potential is equivalent to solving again.
+    auto phi_vec = phi.vector();
+    for (std::size_t j = 0; j < num_objects; ++j)
+    {
+        auto potential = objects[j]->get_potential();
+        if (potential != 0.0)
         {
-            charge += inv_circuit_mat(num_objects + i, j) * circuit_vector[j];
+            phi_vec->axpy(potential, *laplace_solutions[j].vector());
         }
-        objects[i]->set_potential(potential);
-        objects[i]->charge = charge;
     }
+    return true;
 }
 
 void CircuitCM::apply_isources_to_object()
@@ -381,20 +438,32 @@ void CircuitCM::apply_isources_to_object()
 
 bool inv(const boost_matrix &mat, boost_matrix &inv_mat)
 {
-    typedef boost::numeric::ublas::permutation_matrix<std::size_t> pmatrix;
-    
-    boost_matrix A(mat);
-    pmatrix pm(A.size1());
-
-    int res = boost::numeric::ublas::lu_factorize(A, pm);
-    
-    if (res != 0){
+    // Eigen's blocked LU is considerably faster than ublas for large matrices
+    auto n = mat.size1();
+    Eigen::MatrixXd A(n, n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        for (std::size_t j = 0; j < n; ++j)
+        {
+            A(i, j) = mat(i, j);
+        }
+    }
+
+    Eigen::PartialPivLU<Eigen::MatrixXd> lu(A);
+    if ((lu.matrixLU().diagonal().array() == 0.0).any())
+    {
         return false;
     }
- 
-    inv_mat.assign(boost::numeric::ublas::identity_matrix<double>(A.size1()));
-    boost::numeric::ublas::lu_substitute(A, pm, inv_mat);
+    Eigen::MatrixXd A_inv = lu.inverse();
 
+    inv_mat.resize(n, n, false);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        for (std::size_t j = 0; j < n; ++j)
+        {
+            inv_mat(i, j) = A_inv(i, j);
+        }
+    }
     return true;
 }
 
@@ -415,6 +484,8 @@ std::vector<df::Function> laplace_solver(const df::FunctionSpace &V,
     std::vector<df::Function> phi_vec;
     auto shared_V = std::make_shared<df::FunctionSpace>(V);
 
+    // All right-hand sides share the operator and the preconditioner, which
+    // is only set up for the first solve.
     for (std::size_t i = 0; i < num_objects; ++i)
     {
         for (std::size_t j = 0; j < num_objects; ++j)
@@ -428,12 +499,105 @@ std::vector<df::Function> laplace_solver(const df::FunctionSpace &V,
                 objects[j]->set_potential(0.0);
             }
         }
-        df::Function rho(shared_V);
         df::Function phi(shared_V);
-        poisson.solve(phi, rho, objects);
+        poisson.solve_laplace(phi, objects);
         phi_vec.emplace_back(phi);
     }
     return phi_vec;
 }
 
+static std::size_t capacitance_key(const df::FunctionSpace &V,
+                                   const ObjectVector &objects,
+                                   const Mesh &mesh)
+{
+    auto key = setup_key(V, mesh);
+    for (auto &o : objects)
+    {
+        boost::hash_combine(key, o->bnd_id);
+    }
+    return key;
+}
+
+static bool load_capacitance(const std::string &fname, std::size_t key,
+                             const df::FunctionSpace &V,
+                             std::vector<df::Function> &laplace_solutions,
+                             boost_matrix &inv_capacity)
+{
+    std::ifstream file(fname, std::ios::binary);
+    if (!file.good()) return false;
+
+    // Header: key, number of objects, number of dofs
+    std::uint64_t header[3];
+    file.read(reinterpret_cast<char *>(header), sizeof(header));
+    if (!file || header[0] != key || header[2] != V.dim()) return false;
+
+    std::size_t num_objects = header[1];
+    std::size_t num_dofs = header[2];
+
+    std::vector<double> values(num_objects * num_objects);
+    file.read(reinterpret_cast<char *>(values.data()), values.size() * sizeof(double));
+    if (!file) return false;
+
+    boost_matrix mat(num_objects, num_objects);
+    for (std::size_t i = 0; i < num_objects; ++i)
+    {
+        for (std::size_t j = 0; j < num_objects; ++j)
+        {
+            mat(i, j) = values[i * num_objects + j];
+        }
+    }
+
+    auto shared_V = std::make_shared<df::FunctionSpace>(V);
+    std::vector<df::Function> phi_vec;
+    values.resize(num_dofs);
+    for (std::size_t i = 0; i < num_objects; ++i)
+    {
+        file.read(reinterpret_cast<char *>(values.data()), num_dofs * sizeof(double));
+        if (!file) return false;
+
+        df::Function phi(shared_V);
+        phi.vector()->set_local(values);
+        phi.vector()->apply("insert");
+        phi_vec.emplace_back(phi);
+    }
+
+    laplace_solutions = phi_vec;
+    inv_capacity = mat;
+    return true;
+}
+
+static void save_capacitance(const std::string &fname, std::size_t key,
+                             const std::vector<df::Function> &laplace_solutions,
+                             const boost_matrix &inv_capacity)
+{
+    std::ofstream file(fname, std::ios::binary);
+    if (!file.good())
+    {
+        std::cout << "Warning: could not write " << fname << std::endl;
+        return;
+    }
+
+    std::size_t num_objects = laplace_solutions.size();
+    std::size_t num_dofs = num_objects ? laplace_solutions[0].vector()->size() : 0;
+
+    std::uint64_t header[3] = {key, num_objects, num_dofs};
+    file.write(reinterpret_cast<const char *>(header), sizeof(header));
+
+    for (std::size_t i = 0; i < num_objects; ++i)
+    {
+        for (std::size_t j = 0; j < num_objects; ++j)
+        {
+            double value = inv_capacity(i, j);
+            file.write(reinterpret_cast<const char *>(&value), sizeof(double));
+        }
+    }
+
+    std::vector<double> values;
+    for (auto &phi : laplace_solutions)
+    {
+        phi.vector()->get_local(values);
+        file.write(reinterpret_cast<const char *>(values.data()), values.size() * sizeof(double));
+    }
+}
+
 } // namespace punc
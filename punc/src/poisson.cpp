@@ -21,6 +21,12 @@
 #include <dolfin/fem/assemble.h>
 #include <dolfin/function/Constant.h>
 #include <dolfin/math/basic.h>
+#include <dolfin/la/solve.h>
+#include <petscksp.h>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <Eigen/Dense>
 
 #include "../ufl/Potential1D.h"
 #include "../ufl/Potential2D.h"
@@ -45,6 +51,52 @@
 namespace punc
 {
 
+/**
+ * @brief Data for the deflation preconditioner
+ * @see PoissonSolver::set_deflation
+ */
+struct Deflation
+{
+    std::shared_ptr<df::PETScKrylovSolver> inner; ///< Applies original preconditioner
+    std::vector<df::PETScVector> Z;               ///< Deflation vectors
+    std::vector<df::PETScVector> W;               ///< A^T*Z
+    std::vector<Vec> Z_vec, W_vec;                ///< PETSc handles of Z and W
+    Eigen::CompleteOrthogonalDecomposition<Eigen::MatrixXd> E; ///< Factorization of Z^T*A*Z
+};
+
+/**
+ * @brief Applies the deflation preconditioner (PETSc shell preconditioner)
+ * @param       pc  Preconditioner with a Deflation context
+ * @param       r   Residual
+ * @param[out]  z   Preconditioned residual
+ */
+static PetscErrorCode apply_deflation(PC pc, Vec r, Vec z)
+{
+    void *ctx;
+    PCShellGetContext(pc, &ctx);
+    auto &d = *static_cast<Deflation *>(ctx);
+    auto k = d.Z.size();
+
+    // u = M^{-1}*r (stored in z)
+    KSPSolve(d.inner->ksp(), r, z);
+
+    // Z^T*(r - A*u) = Z^T*r - (A^T*Z)^T*u
+    std::vector<PetscScalar> Zr(k), Wu(k);
+    VecMDot(r, k, d.Z_vec.data(), Zr.data());
+    VecMDot(z, k, d.W_vec.data(), Wu.data());
+
+    Eigen::VectorXd rhs(k);
+    for (std::size_t i = 0; i < k; ++i)
+    {
+        rhs[i] = Zr[i] - Wu[i];
+    }
+    Eigen::VectorXd coefficients = d.E.solve(rhs);
+
+    // z = u + Z*E^{-1}*Z^T*(r - A*u)
+    VecMAXPY(z, k, coefficients.data(), d.Z_vec.data());
+    return 0;
+}
+
 df::FunctionSpace CG1_space(const Mesh &mesh,
                             boost::optional<std::shared_ptr<PeriodicBoundary>> constr)
 {
@@ -264,7 +316,8 @@ PoissonSolver::PoissonSolver(const df::FunctionSpace &V,
                              double eps0,
                              bool remove_null_space,
                              std::string method,
-                             std::string preconditioner) : 
+                             std::string preconditioner,
+                             std::shared_ptr<SetupCache> cache) : 
                              ext_bc(ext_bc),
                              remove_null_space(remove_null_space)
 {
@@ -287,46 +340,79 @@ PoissonSolver::PoissonSolver(const df::FunctionSpace &V,
         L = std::make_shared<Potential3D::LinearForm>(V_shared);
     }
 
-    if(circuit){
+    // The direct solver works for any circuit since the factorization is exact
+    bool direct = (method == "direct-cached");
+
+    if(circuit && !direct){
         // Assigns default solvers if method==preconditioner==""
         bool ok = circuit->check_solver_methods(method, preconditioner);
         if(!ok){
             std::cout << "Warning: " << method << "/" << preconditioner;
             std::cout << " solver may not converge for this circuit\n";
         }
-    } else {
+    } else if(!direct) {
         if(method=="" && preconditioner==""){
             method = "gmres";
             preconditioner = "hypre_amg";
         }
     }
 
-    solver = std::make_shared<df::PETScKrylovSolver>(V.mesh()->mpi_comm(), method, preconditioner);
-
     if(ext_bc){
         num_bcs = ext_bc->size();
     }
     
-    df::assemble(A, *a);
-    
-    for (std::size_t i = 0; i < num_bcs; ++i)
-    {
-        ext_bc.get()[i].apply(A);
-    }
+    bool cached = cache && cache->valid() &&
+                  load_operator(cache->path("operator"), V.dim());
 
-    for (auto &bc : objects)
-    {
-        bc->apply(A);
-    }
+    if(cached){
+        std::cout << "  Poisson operator loaded from " << cache->path("operator") << std::endl;
+    } else {
+        df::assemble(A, *a);
+
+        for (std::size_t i = 0; i < num_bcs; ++i)
+        {
+            ext_bc.get()[i].apply(A);
+        }
+
+        for (auto &bc : objects)
+        {
+            bc->apply(A);
+        }
+
+        if(circuit){
+            circuit->apply(A);
+        }
 
-    if(circuit){
-        circuit->apply(A);
+        if(cache && cache->enabled()){
+            save_operator(cache->path("operator"));
+        }
     }
 
-    solver->parameters["absolute_tolerance"] = 1e-14;
-    solver->parameters["relative_tolerance"] = 1e-12;
-    solver->parameters["maximum_iterations"] = 1000;
-    solver->set_reuse_preconditioner(true);
+    compile_bcs(objects);
+
+    if(direct){
+        std::string lu_method = df::has_lu_solver_method("mumps") ? "mumps" : "petsc";
+        lu_solver = std::make_shared<df::PETScLUSolver>(V.mesh()->mpi_comm(), lu_method);
+
+        // Factorize the final matrix (including object and circuit rows)
+        // once. PETSc keeps the factors as long as A is unchanged.
+        df::PETScVector x0, b0;
+        A.init_vector(x0, 1);
+        A.init_vector(b0, 0);
+        lu_solver->solve(A, x0, b0);
+
+        if(remove_null_space){
+            std::cout << "Warning: direct-cached solver cannot remove null space\n";
+        }
+    } else {
+        solver = std::make_shared<df::PETScKrylovSolver>(V.mesh()->mpi_comm(), method, preconditioner);
+        this->preconditioner = preconditioner;
+        solver->parameters["absolute_tolerance"] = 1e-14;
+        solver->parameters["relative_tolerance"] = 1e-12;
+        solver->parameters["maximum_iterations"] = 1000;
+        solver->parameters["nonzero_initial_guess"] = false;
+        solver->set_reuse_preconditioner(true);
+    }
 
     if (remove_null_space)
     {
@@ -346,19 +432,149 @@ void PoissonSolver::solve(df::Function &phi, const df::Function &rho,
 {
     L->set_coefficient("rho", std::make_shared<df::Function>(rho));
     df::assemble(b, *L);
+    solve_system(phi, objects, circuit);
+}
+
+void PoissonSolver::solve_laplace(df::Function &phi, ObjectVector &objects)
+{
+    if(b.empty()) A.init_vector(b, 0);
+    b.zero();
+    solve_system(phi, objects, nullptr);
+}
+
+bool PoissonSolver::load_operator(const std::string &fname, std::size_t size)
+{
+    std::ifstream file(fname);
+    if(!file.good()) return false;
+    file.close();
+
+    PetscViewer viewer;
+    Mat mat;
+    MatCreate(PETSC_COMM_SELF, &mat);
+    MatSetType(mat, MATAIJ);
+    PetscViewerBinaryOpen(PETSC_COMM_SELF, fname.c_str(), FILE_MODE_READ, &viewer);
+    PetscErrorCode ierr = MatLoad(mat, viewer);
+    PetscViewerDestroy(&viewer);
+
+    PetscInt m = 0, n = 0;
+    if(!ierr) MatGetSize(mat, &m, &n);
+
+    bool ok = !ierr && (std::size_t)m == size && (std::size_t)n == size;
+    if(ok) A = df::PETScMatrix(mat);
+    MatDestroy(&mat);
+    return ok;
+}
+
+void PoissonSolver::save_operator(const std::string &fname)
+{
+    PetscViewer viewer;
+    PetscViewerBinaryOpen(PETSC_COMM_SELF, fname.c_str(), FILE_MODE_WRITE, &viewer);
+    MatView(A.mat(), viewer);
+    PetscViewerDestroy(&viewer);
+}
+
+void PoissonSolver::compile_bcs(ObjectVector &objects)
+{
+    // A later boundary condition overrides an earlier one on shared dofs,
+    // as when applying them one at a time. The value is either a constant
+    // (object < 0) or the potential of an object.
+    std::map<df::la_index, std::pair<int, double>> entries;
 
     for(std::size_t i = 0; i<num_bcs; ++i)
     {
-        ext_bc.get()[i].apply(b);
+        df::DirichletBC::Map dof_map;
+        ext_bc.get()[i].get_boundary_values(dof_map);
+        for(auto &dof : dof_map)
+        {
+            entries[dof.first] = std::make_pair(-1, dof.second);
+        }
     }
-    for(auto& bc: objects)
+
+    std::vector<df::la_index> dofs;
+    bool potential;
+    for(std::size_t i = 0; i<objects.size(); ++i)
     {
-        bc->apply(b);
+        if(!objects[i]->vector_dofs(dofs, potential))
+        {
+            bcs_compiled = false;
+            return;
+        }
+        for(auto &dof : dofs)
+        {
+            entries[dof] = potential ? std::make_pair((int)i, 0.0)
+                                     : std::make_pair(-1, 0.0);
+        }
+    }
+
+    bc_dofs.clear();
+    bc_values.clear();
+    bc_objects.clear();
+    for(auto &entry : entries)
+    {
+        if(entry.second.first < 0)
+        {
+            bc_dofs.push_back(entry.first);
+            bc_values.push_back(entry.second.second);
+        }
+    }
+    num_fixed_dofs = bc_dofs.size();
+    for(auto &entry : entries)
+    {
+        if(entry.second.first >= 0)
+        {
+            bc_dofs.push_back(entry.first);
+            bc_values.push_back(0.0);
+            bc_objects.push_back(entry.second.first);
+        }
+    }
+
+    num_compiled_objects = objects.size();
+    bcs_compiled = true;
+}
+
+void PoissonSolver::solve_system(df::Function &phi, ObjectVector &objects,
+                                 std::shared_ptr<Circuit> circuit)
+{
+    if(bcs_compiled && objects.size() == num_compiled_objects)
+    {
+        for(std::size_t i = 0; i<bc_objects.size(); ++i)
+        {
+            bc_values[num_fixed_dofs + i] = objects[bc_objects[i]]->get_potential();
+        }
+        b.set_local(bc_values.data(), bc_dofs.size(), bc_dofs.data());
+        b.apply("insert");
+    }
+    else
+    {
+        for(std::size_t i = 0; i<num_bcs; ++i)
+        {
+            ext_bc.get()[i].apply(b);
+        }
+        for(auto& bc: objects)
+        {
+            bc->apply(b);
+        }
     }
     if(circuit) circuit->apply(b);
     if(remove_null_space) null_space->orthogonalize(b);
 
-    solver->solve(A, *phi.vector(), b);
+    auto start = std::chrono::high_resolution_clock::now();
+    if(lu_solver){
+        stats.iterations = lu_solver->solve(A, *phi.vector(), b);
+    } else {
+        stats.iterations = solver->solve(A, *phi.vector(), b);
+    }
+    auto stop = std::chrono::high_resolution_clock::now();
+
+    stats.time = std::chrono::duration<double>(stop - start).count();
+    if(lu_solver){
+        // The direct solver does not compute any residual by itself
+        stats.residual = residual(phi);
+        stats.tolerance = 0;
+    } else {
+        KSPGetResidualNorm(solver->ksp(), &stats.residual);
+        stats.tolerance = solver->parameters["relative_tolerance"];
+    }
 }
 
 void PoissonSolver::solve_circuit(df::Function &phi, const df::Function &rho,
@@ -370,8 +586,11 @@ void PoissonSolver::solve_circuit(df::Function &phi, const df::Function &rho,
     solve(phi, rho, objects, circuit);
     circuit->post_solve(phi, mesh);
 
-    if(circuit->correction_required){
+    if(circuit->correction_required && !circuit->correct(phi)){
+        auto first = stats;
         solve(phi, rho, objects, circuit);
+        stats.iterations += first.iterations;
+        stats.time += first.time;
     }
 }
 
@@ -384,6 +603,85 @@ double PoissonSolver::residual(const df::Function &phi)
     return residual.norm("l2");
 }
 
+double PoissonSolver::set_adaptive_reltol(double particles_per_dof,
+                                          double safety, double min_tol)
+{
+    if(!solver) return 0;
+
+    double tol = safety / sqrt(std::max(particles_per_dof, 1.0));
+    tol = std::max(tol, min_tol);
+    set_reltol(tol);
+    return tol;
+}
+
+void PoissonSolver::set_deflation(const std::vector<df::Function> &vectors)
+{
+    if(!solver){
+        std::cout << "Warning: deflation requires an iterative solver\n";
+        return;
+    }
+
+    deflation = std::make_shared<Deflation>();
+    auto &Z = deflation->Z;
+    auto &W = deflation->W;
+
+    for(auto &v : vectors){
+        Z.emplace_back(df::as_type<const df::PETScVector>(*v.vector()));
+    }
+    if(remove_null_space){
+        Z.emplace_back(df::as_type<const df::PETScVector>(*(*null_space)[0]));
+    }
+
+    auto k = Z.size();
+    W.resize(k);
+    for(std::size_t i = 0; i < k; ++i){
+        A.init_vector(W[i], 1);
+        A.transpmult(Z[i], W[i]);
+    }
+    for(std::size_t i = 0; i < k; ++i){
+        deflation->Z_vec.push_back(Z[i].vec());
+        deflation->W_vec.push_back(W[i].vec());
+    }
+
+    // E is singular if the null space vector is included. The complete
+    // orthogonal decomposition then yields the minimum norm correction.
+    Eigen::MatrixXd E(k, k);
+    for(std::size_t i = 0; i < k; ++i){
+        for(std::size_t j = 0; j < k; ++j){
+            E(i, j) = W[i].inner(Z[j]);
+        }
+    }
+    deflation->E.compute(E);
+
+    // The original preconditioner, applied once
+    deflation->inner = std::make_shared<df::PETScKrylovSolver>(A.mpi_comm(), "preonly", preconditioner);
+    deflation->inner->set_operator(A);
+    KSPSetUp(deflation->inner->ksp());
+
+    PC pc;
+    KSPGetPC(solver->ksp(), &pc);
+    PCSetType(pc, PCSHELL);
+    PCShellSetContext(pc, deflation.get());
+    PCShellSetApply(pc, apply_deflation);
+    PCShellSetName(pc, "deflation");
+}
+
+double PoissonSolver::factorization_memory() const
+{
+    if(!lu_solver) return 0;
+
+    PC pc;
+    Mat F;
+    MatInfo info;
+    KSPGetPC(lu_solver->ksp(), &pc);
+    PCFactorGetMatrix(pc, &F);
+    MatGetInfo(F, MAT_GLOBAL_SUM, &info);
+
+    // Not all external packages report memory, but all report non-zeros
+    if(info.memory > 0) return info.memory;
+    return info.nz_used * (sizeof(PetscScalar) + sizeof(PetscInt));
+}
+
 double errornorm(const df::Function &phi, const df::Function &phi_e)
 {
     auto mesh = phi.function_space()->mesh();
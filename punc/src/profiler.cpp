@@ -0,0 +1,636 @@
+// Copyright (C) 2018, Diako Darian and Sigvald Marholm
+//
+// This file is part of PUNC++.
+//
+// PUNC++ is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// PUNC++ is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// PUNC++. If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ * @file		profiler.cpp
+ * @brief		Hierarchical profiling of time-steps
+ */
+
+#include "../include/punc/profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <sstream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace punc
+{
+
+bool HardwareCounters::open()
+{
+#ifdef __linux__
+    if (is_open())
+    {
+        return true;
+    }
+
+    const std::uint64_t configs[num_events] = {PERF_COUNT_HW_CPU_CYCLES,
+                                               PERF_COUNT_HW_INSTRUCTIONS,
+                                               PERF_COUNT_HW_CACHE_MISSES,
+                                               PERF_COUNT_HW_BRANCH_MISSES};
+
+    // The cycle counter leads the group, and the others are optional
+    for (int e = 0; e < num_events; ++e)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[e];
+        attr.disabled = e == cycles;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1,
+                         e == cycles ? -1 : fds[cycles], PERF_FLAG_FD_CLOEXEC);
+        if (fds[cycles] < 0)
+        {
+            return false;
+        }
+    }
+
+    ioctl(fds[cycles], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[cycles], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void HardwareCounters::close()
+{
+#ifdef __linux__
+    // Members before the leader
+    for (int e = num_events - 1; e >= 0; --e)
+    {
+        if (fds[e] >= 0)
+        {
+            ::close(fds[e]);
+        }
+    }
+#endif
+    fds.fill(-1);
+}
+
+void HardwareCounters::read(Values &values) const
+{
+    values.fill(0.0);
+#ifdef __linux__
+    if (!is_open())
+    {
+        return;
+    }
+
+    // Number of events, time enabled, time running and the counts
+    std::uint64_t buffer[3 + num_events];
+    if (::read(fds[cycles], buffer, sizeof(buffer)) < 3 * 8)
+    {
+        return;
+    }
+    double scale = buffer[2] > 0 ? double(buffer[1]) / buffer[2] : 0.0;
+
+    std::size_t k = 0;
+    for (int e = 0; e < num_events; ++e)
+    {
+        if (fds[e] >= 0 && k < buffer[0])
+        {
+            values[e] = scale * buffer[3 + k++];
+        }
+        else
+        {
+            values[e] = std::numeric_limits<double>::quiet_NaN();
+        }
+    }
+#endif
+}
+
+/**
+ * @brief Hands the data of a thread back to the profiler when it finishes
+ */
+struct ThreadHandle
+{
+    Profiler::ThreadData *data = nullptr;
+    ~ThreadHandle()
+    {
+        if (data)
+        {
+            Profiler::instance().release(data);
+        }
+    }
+};
+
+Profiler &Profiler::instance()
+{
+    // Never destroyed, since threads may hand back their data at exit
+    static Profiler *profiler = new Profiler();
+    return *profiler;
+}
+
+Profiler::Profiler() : start(clock::now())
+{
+    // Do nothing
+}
+
+Profiler::ThreadData &Profiler::thread_data()
+{
+    thread_local ThreadHandle handle;
+    if (!handle.data)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!free.empty())
+        {
+            handle.data = free.back();
+            free.pop_back();
+        }
+        else
+        {
+            threads.emplace_back(new ThreadData);
+            handle.data = threads.back().get();
+            handle.data->id = threads.size() - 1;
+            handle.data->nodes.emplace_back();
+            handle.data->nodes[0].parent = 0;
+        }
+        if (hardware)
+        {
+            handle.data->hardware.open();
+        }
+    }
+    return *handle.data;
+}
+
+void Profiler::release(ThreadData *data)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    data->stack.clear();
+    data->hardware.close();
+    free.push_back(data);
+}
+
+void Profiler::begin(const std::string &name)
+{
+    auto &data = thread_data();
+    auto parent = data.stack.empty() ? 0 : data.stack.back().node;
+
+    std::size_t node = 0;
+    for (auto child : data.nodes[parent].children)
+    {
+        if (data.nodes[child].name == name)
+        {
+            node = child;
+            break;
+        }
+    }
+    if (node == 0)
+    {
+        node = data.nodes.size();
+        data.nodes.emplace_back();
+        data.nodes[node].name = name;
+        data.nodes[node].parent = parent;
+        data.nodes[node].steps.assign(num_steps, 0.0f);
+        data.nodes[parent].children.push_back(node);
+    }
+
+    Frame frame;
+    frame.node = node;
+    frame.counting = data.hardware.is_open();
+    frame.begin = clock::now();
+    if (frame.counting)
+    {
+        data.hardware.read(frame.events);
+    }
+    data.stack.push_back(frame);
+}
+
+void Profiler::end()
+{
+    auto &data = thread_data();
+    if (data.stack.empty())
+    {
+        return;
+    }
+
+    auto &top = data.stack.back();
+    auto &node = data.nodes[top.node];
+    if (top.counting && data.hardware.is_open())
+    {
+        HardwareCounters::Values events;
+        data.hardware.read(events);
+        for (std::size_t e = 0; e < events.size(); ++e)
+        {
+            node.events[e] += events[e] - top.events[e];
+        }
+    }
+
+    auto now = clock::now();
+    double time = std::chrono::duration<double>(now - top.begin).count();
+    node.total += time;
+    node.step_time += time;
+    node.calls += 1;
+
+    if (trace)
+    {
+        double begin = std::chrono::duration<double, std::micro>(top.begin - start).count();
+        data.events.push_back({top.node, begin, time * 1e6});
+    }
+    data.stack.pop_back();
+}
+
+void Profiler::count(const std::string &name, double value)
+{
+    thread_data().counters[name] += value;
+}
+
+std::string Profiler::path(const ThreadData &data, std::size_t node) const
+{
+    std::string res = data.nodes[node].name;
+    for (node = data.nodes[node].parent; node != 0; node = data.nodes[node].parent)
+    {
+        res = data.nodes[node].name + "/" + res;
+    }
+    return res;
+}
+
+void Profiler::step(std::size_t n)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::map<std::string, double> times, values;
+    for (auto &data : threads)
+    {
+        for (std::size_t i = 1; i < data->nodes.size(); ++i)
+        {
+            auto &node = data->nodes[i];
+            if (node.step_time > 0)
+            {
+                times[path(*data, i)] += node.step_time;
+            }
+            node.steps.push_back(node.step_time);
+            node.step_time = 0;
+        }
+        for (auto &counter : data->counters)
+        {
+            values[counter.first] += counter.second;
+        }
+        data->counters.clear();
+    }
+
+    for (auto &value : values)
+    {
+        counters[value.first].resize(num_steps, 0.0);
+    }
+    for (auto &counter : counters)
+    {
+        auto it = values.find(counter.first);
+        counter.second.push_back(it == values.end() ? 0.0 : it->second);
+    }
+    num_steps += 1;
+
+    if (trace)
+    {
+        double now = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+        step_ends.push_back(now);
+    }
+
+    if (csv.is_open())
+    {
+        for (auto &time : times)
+        {
+            csv << n << ",time," << time.first << "," << time.second << '\n';
+        }
+        for (auto &value : values)
+        {
+            csv << n << ",counter," << value.first << "," << value.second << '\n';
+        }
+    }
+}
+
+void Profiler::open_csv(const std::string &fname)
+{
+    csv.open(fname);
+    csv << "step,type,name,value\n";
+}
+
+void Profiler::enable_trace()
+{
+    trace = true;
+}
+
+bool Profiler::enable_hardware_counters(const std::string &particles)
+{
+    auto &data = thread_data();
+    if (!data.hardware.open())
+    {
+        std::cerr << "Warning: Hardware performance counters are unavailable "
+                  << "(see /proc/sys/kernel/perf_event_paranoid). "
+                  << "Profiling without them." << std::endl;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    hardware = true;
+    this->particles = particles;
+    return true;
+}
+
+//! Escapes a string for JSON
+static std::string escape(const std::string &str)
+{
+    std::string res;
+    for (auto c : str)
+    {
+        if (c == '"' || c == '\\')
+        {
+            res += '\\';
+        }
+        res += c;
+    }
+    return res;
+}
+
+void Profiler::write_trace(const std::string &fname)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::ofstream file(fname);
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    for (auto &data : threads)
+    {
+        for (auto &event : data->events)
+        {
+            file << (first ? "" : ",\n")
+                 << "{\"name\":\"" << escape(data->nodes[event.node].name)
+                 << "\",\"cat\":\"" << escape(path(*data, event.node))
+                 << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << data->id
+                 << ",\"ts\":" << std::fixed << std::setprecision(3) << event.begin
+                 << ",\"dur\":" << event.duration << "}";
+            first = false;
+        }
+    }
+    for (auto &counter : counters)
+    {
+        auto offset = step_ends.size() - std::min(step_ends.size(), counter.second.size());
+        for (std::size_t i = 0; i < counter.second.size() && offset + i < step_ends.size(); ++i)
+        {
+            file << (first ? "" : ",\n")
+                 << "{\"name\":\"" << escape(counter.first)
+                 << "\",\"ph\":\"C\",\"pid\":0,\"ts\":"
+                 << std::fixed << std::setprecision(3) << step_ends[offset + i]
+                 << ",\"args\":{\"value\":" << std::defaultfloat << std::setprecision(17)
+                 << counter.second[i] << "}}";
+            first = false;
+        }
+    }
+    file << "\n]}\n";
+}
+
+double Profiler::elapsed() const
+{
+    return std::chrono::duration<double>(clock::now() - start).count();
+}
+
+//! Formats a number, or "-" if it is not finite (e.g. unavailable counters)
+static std::string format(double value, int precision)
+{
+    if (!std::isfinite(value))
+    {
+        return "-";
+    }
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(precision) << value;
+    return oss.str();
+}
+
+//! Mean, minimum, maximum and 95th percentile of per-step values (NaN if
+//! no steps were recorded, i.e. if step() was never called)
+static void statistics(std::vector<double> values, double &mean, double &min,
+                       double &max, double &p95)
+{
+    mean = min = max = p95 = std::numeric_limits<double>::quiet_NaN();
+    if (values.empty())
+    {
+        return;
+    }
+    mean = std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    auto minmax = std::minmax_element(values.begin(), values.end());
+    min = *minmax.first;
+    max = *minmax.second;
+    auto k = static_cast<std::size_t>(0.95 * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + k, values.end());
+    p95 = values[k];
+}
+
+void Profiler::summary(const std::vector<std::string> &order)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // Merge the trees of all threads by path, in order of first appearance
+    struct Entry
+    {
+        std::size_t depth = 0, calls = 0;
+        double total = 0;
+        std::vector<double> steps;
+        HardwareCounters::Values events{};
+    };
+    std::vector<std::string> paths;
+    std::map<std::string, Entry> entries;
+
+    for (auto &data : threads)
+    {
+        // Depth-first traversal, such that children follow their parent
+        std::vector<std::size_t> stack(data->nodes[0].children.rbegin(),
+                                       data->nodes[0].children.rend());
+        while (!stack.empty())
+        {
+            auto i = stack.back();
+            stack.pop_back();
+            auto &node = data->nodes[i];
+            auto p = path(*data, i);
+
+            if (!entries.count(p))
+            {
+                paths.push_back(p);
+            }
+            auto &entry = entries[p];
+            entry.depth = std::count(p.begin(), p.end(), '/');
+            entry.calls += node.calls;
+            entry.total += node.total;
+            entry.steps.resize(node.steps.size(), 0.0);
+            for (std::size_t s = 0; s < node.steps.size(); ++s)
+            {
+                entry.steps[s] += node.steps[s];
+            }
+            for (std::size_t e = 0; e < node.events.size(); ++e)
+            {
+                entry.events[e] += node.events[e];
+            }
+
+            stack.insert(stack.end(), node.children.rbegin(), node.children.rend());
+        }
+    }
+
+    // Top-level scopes in the given order first, each followed by its children
+    auto rank = [&](const std::string &p) {
+        auto top = p.substr(0, p.find('/'));
+        auto it = std::find(order.begin(), order.end(), top);
+        return static_cast<std::size_t>(std::distance(order.begin(), it));
+    };
+    std::stable_sort(paths.begin(), paths.end(),
+                     [&](const std::string &a, const std::string &b) {
+                         return rank(a) < rank(b);
+                     });
+
+    auto total_time = elapsed();
+    std::size_t len = 12;
+    for (auto &p : paths)
+    {
+        auto &entry = entries[p];
+        auto name = p.substr(p.rfind('/') + 1);
+        len = std::max(len, 2 * entry.depth + name.length());
+    }
+    auto width = len + 2 + 12 + 8 + 10 + 4 * 11;
+    auto line = std::string(width, '-');
+
+    std::cout << line << '\n'
+              << std::setw((width + 16) / 2) << std::right << "Summary of tasks" << '\n'
+              << line << '\n'
+              << std::left << std::setw(len + 2) << "Task"
+              << std::right << std::setw(12) << "Time [s]"
+              << std::setw(8) << "%"
+              << std::setw(10) << "Calls"
+              << std::setw(11) << "Mean [ms]"
+              << std::setw(11) << "Min [ms]"
+              << std::setw(11) << "Max [ms]"
+              << std::setw(11) << "P95 [ms]" << '\n'
+              << line << '\n';
+
+    for (auto &p : paths)
+    {
+        auto &entry = entries[p];
+        auto name = std::string(2 * entry.depth, ' ') + p.substr(p.rfind('/') + 1);
+        double mean, min, max, p95;
+        statistics(entry.steps, mean, min, max, p95);
+
+        std::cout << std::left << std::setw(len + 2) << name << std::right
+                  << std::fixed << std::setprecision(3)
+                  << std::setw(12) << entry.total
+                  << std::setprecision(2)
+                  << std::setw(8) << 100 * entry.total / total_time
+                  << std::setw(10) << entry.calls
+                  << std::setw(11) << format(1e3 * mean, 3)
+                  << std::setw(11) << format(1e3 * min, 3)
+                  << std::setw(11) << format(1e3 * max, 3)
+                  << std::setw(11) << format(1e3 * p95, 3) << '\n';
+    }
+
+    if (!counters.empty())
+    {
+        std::cout << line << '\n'
+                  << std::left << std::setw(len + 2) << "Counter"
+                  << std::right << std::setw(12) << "Total"
+                  << std::setw(18) << ""
+                  << std::setw(11) << "Mean"
+                  << std::setw(11) << "Min"
+                  << std::setw(11) << "Max"
+                  << std::setw(11) << "P95" << '\n'
+                  << line << '\n';
+
+        for (auto &counter : counters)
+        {
+            double mean, min, max, p95;
+            statistics(counter.second, mean, min, max, p95);
+            auto total = std::accumulate(counter.second.begin(), counter.second.end(), 0.0);
+
+            std::cout << std::left << std::setw(len + 2) << counter.first << std::right
+                      << std::setprecision(4) << std::defaultfloat
+                      << std::setw(12) << total
+                      << std::setw(18) << ""
+                      << std::setw(11) << mean
+                      << std::setw(11) << min
+                      << std::setw(11) << max
+                      << std::setw(11) << p95 << '\n';
+        }
+    }
+
+    if (hardware)
+    {
+        // Memory traffic is estimated as one cache line per last-level miss
+        const double cache_line = 64;
+        double num_particles = 0;
+        auto it = counters.find(particles);
+        if (it != counters.end())
+        {
+            num_particles = std::accumulate(it->second.begin(), it->second.end(), 0.0);
+        }
+
+        std::cout << line << '\n'
+                  << std::left << std::setw(len + 2) << "Hardware counters"
+                  << std::right << std::setw(12) << "Cycles [G]"
+                  << std::setw(8) << "IPC"
+                  << std::setw(10) << "LLC [M]"
+                  << std::setw(11) << "Branch [M]"
+                  << std::setw(11) << "Mem [GB/s]"
+                  << std::setw(11) << "Mem [B/p]" << '\n'
+                  << line << '\n';
+
+        for (auto &p : paths)
+        {
+            auto &entry = entries[p];
+            auto name = std::string(2 * entry.depth, ' ') + p.substr(p.rfind('/') + 1);
+            auto &events = entry.events;
+            double bytes = cache_line * events[HardwareCounters::cache_misses];
+            double nan = std::numeric_limits<double>::quiet_NaN();
+
+            std::cout << std::left << std::setw(len + 2) << name << std::right
+                      << std::setw(12) << format(1e-9 * events[HardwareCounters::cycles], 3)
+                      << std::setw(8) << format(events[HardwareCounters::instructions] /
+                                                events[HardwareCounters::cycles], 2)
+                      << std::setw(10) << format(1e-6 * events[HardwareCounters::cache_misses], 2)
+                      << std::setw(11) << format(1e-6 * events[HardwareCounters::branch_misses], 2)
+                      << std::setw(11) << format(entry.total > 0 ? 1e-9 * bytes / entry.total : nan, 2)
+                      << std::setw(11) << format(num_particles > 0 ? bytes / num_particles : nan, 1)
+                      << '\n';
+        }
+    }
+
+    std::cout << line << '\n'
+              << std::fixed << std::setprecision(3)
+              << "Total run time: " << total_time << " s over "
+              << num_steps << " steps" << '\n'
+              << line << std::endl;
+    std::cout << std::defaultfloat;
+
+    if (csv.is_open())
+    {
+        csv.flush();
+    }
+}
+
+} // namespace punc
@@ -0,0 +1,102 @@
+// Copyright (C) 2018, Diako Darian and Sigvald Marholm
+//
+// This file is part of PUNC++.
+//
+// PUNC++ is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// PUNC++ is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// PUNC++. If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ * @file		random.cpp
+ * @brief		Reproducible random number streams
+ */
+
+#include "../include/punc/random.h"
+
+#include <mutex>
+#include <numeric>
+#include <random>
+
+namespace punc
+{
+
+static std::mutex seed_mutex;
+static bool seed_set = false;
+static std::uint64_t seed_value = 0;
+
+void set_seed(std::uint64_t seed)
+{
+    std::lock_guard<std::mutex> lock(seed_mutex);
+    seed_value = seed;
+    seed_set = true;
+}
+
+std::uint64_t get_seed()
+{
+    std::lock_guard<std::mutex> lock(seed_mutex);
+    if (!seed_set)
+    {
+        std::random_device device;
+        seed_value = (std::uint64_t(device()) << 32) | device();
+        seed_set = true;
+    }
+    return seed_value;
+}
+
+AliasTable::AliasTable(const std::vector<double> &weights)
+    : prob(weights.size()), alias(weights.size())
+{
+    auto n = weights.size();
+    auto sum = std::accumulate(weights.begin(), weights.end(), 0.0);
+
+    std::vector<std::size_t> small, large;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        prob[i] = weights[i] * n / sum;
+        alias[i] = i;
+        if (prob[i] < 1.0)
+        {
+            small.push_back(i);
+        }
+        else
+        {
+            large.push_back(i);
+        }
+    }
+
+    // Fill up each small bin with the excess of a large bin
+    while (!small.empty() && !large.empty())
+    {
+        auto s = small.back();
+        auto l = large.back();
+        small.pop_back();
+        alias[s] = l;
+        prob[l] -= 1.0 - prob[s];
+        if (prob[l] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    // Remaining bins are full up to round-off errors
+    for (auto i : small)
+    {
+        prob[i] = 1.0;
+    }
+    for (auto i : large)
+    {
+        prob[i] = 1.0;
+    }
+}
+
+} // namespace punc
@@ -0,0 +1,126 @@
+// Copyright (C) 2018, Diako Darian and Sigvald Marholm
+//
+// This file is part of PUNC++.
+//
+// PUNC++ is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// PUNC++ is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// PUNC++. If not, see <http://www.gnu.org/licenses/>.
+
+/**
+ * @file		setup_cache.cpp
+ * @brief		Cache for quantities computed during setup
+ */
+
+#include "../include/punc/setup_cache.h"
+
+#include <dolfin/fem/GenericDofMap.h>
+#include <boost/filesystem.hpp>
+#include <boost/functional/hash.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+namespace punc
+{
+
+std::size_t setup_key(const df::FunctionSpace &V, const Mesh &mesh)
+{
+    auto key = mesh.hash();
+    auto dofmap = V.dofmap();
+    for (std::size_t c = 0; c < mesh.mesh->num_cells(); ++c)
+    {
+        auto dofs = dofmap->cell_dofs(c);
+        boost::hash_range(key, dofs.data(), dofs.data() + dofs.size());
+    }
+    return key;
+}
+
+SetupCache::SetupCache(const std::string &fname, std::size_t key,
+                       MPI_Comm comm)
+    : fname(fname), key(key), active(df::MPI::size(comm) == 1)
+{
+    if (!active) return;
+
+    std::ifstream file(fname, std::ios::binary);
+    if (!file.good()) return;
+
+    // Header: key, number of entries
+    std::uint64_t header[2];
+    file.read(reinterpret_cast<char *>(header), sizeof(header));
+
+    if (!file || header[0] != key)
+    {
+        // Stale cache. Remove it such that files in path() written by this
+        // run are not trusted together with it by a later run.
+        file.close();
+        std::remove(fname.c_str());
+        std::cout << "  Setup cache " << fname << " is outdated" << std::endl;
+        return;
+    }
+
+    // Entries: name length, name, data size (bytes), data
+    for (std::uint64_t i = 0; i < header[1]; ++i)
+    {
+        std::uint64_t size;
+        file.read(reinterpret_cast<char *>(&size), sizeof(size));
+        std::string name(size, '\0');
+        file.read(&name[0], size);
+
+        file.read(reinterpret_cast<char *>(&size), sizeof(size));
+        auto &data = entries[name];
+        data.resize(size);
+        file.read(data.data(), size);
+    }
+
+    if (!file)
+    {
+        entries.clear();
+        return;
+    }
+
+    loaded = true;
+    std::cout << "  Setup cache loaded from " << fname << std::endl;
+}
+
+std::string SetupCache::path(const std::string &name) const
+{
+    boost::filesystem::path p(fname);
+    auto stem = p.stem().string() + "_" + name + p.extension().string();
+    return (p.parent_path() / stem).string();
+}
+
+void SetupCache::save()
+{
+    if (!active || !modified) return;
+
+    std::ofstream file(fname, std::ios::binary);
+
+    std::uint64_t header[2] = {key, entries.size()};
+    file.write(reinterpret_cast<const char *>(header), sizeof(header));
+
+    for (auto &entry : entries)
+    {
+        std::uint64_t size = entry.first.size();
+        file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        file.write(entry.first.data(), size);
+
+        size = entry.second.size();
+        file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        file.write(entry.second.data(), size);
+    }
+
+    loaded = true;
+    modified = false;
+}
+
+} // namespace punc
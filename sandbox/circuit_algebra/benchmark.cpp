@@ -0,0 +1,117 @@
+// Benchmark of the dense circuit algebra in CircuitCM.
+//
+// Compares the previous approach (explicit inversion of the 2N x 2N circuit
+// matrix with ublas, and applying the inverse with a hand-written loop every
+// time-step) with the current approach (Eigen's blocked LU factorization
+// once, and a forward/backward substitution every time-step) for N objects.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+
+#include <boost/numeric/ublas/matrix.hpp>
+#include <boost/numeric/ublas/lu.hpp>
+#include <Eigen/Dense>
+
+using boost_matrix = boost::numeric::ublas::matrix<double>;
+using Clock = std::chrono::high_resolution_clock;
+
+double seconds(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// The previous implementation of inv() in object_CM.cpp
+void ublas_inv(const boost_matrix &mat, boost_matrix &inv_mat)
+{
+    typedef boost::numeric::ublas::permutation_matrix<std::size_t> pmatrix;
+    boost_matrix A(mat);
+    pmatrix pm(A.size1());
+    boost::numeric::ublas::lu_factorize(A, pm);
+    inv_mat.assign(boost::numeric::ublas::identity_matrix<double>(A.size1()));
+    boost::numeric::ublas::lu_substitute(A, pm, inv_mat);
+}
+
+int main()
+{
+    std::vector<std::size_t> num_objects = {1, 2, 5, 10, 20, 50, 100, 200, 500};
+    std::size_t steps = 1000;
+
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+
+    std::cout << std::setw(8) << "objects"
+              << std::setw(16) << "setup ublas"
+              << std::setw(16) << "setup eigen"
+              << std::setw(16) << "step ublas"
+              << std::setw(16) << "step eigen"
+              << std::setw(16) << "max diff" << std::endl;
+
+    for (auto n : num_objects)
+    {
+        // A dense, diagonally dominant matrix the size of the circuit matrix
+        // (all objects connected through voltage sources).
+        std::size_t m = 2 * n;
+        Eigen::MatrixXd A(m, m);
+        boost_matrix A_ublas(m, m);
+        for (std::size_t i = 0; i < m; ++i)
+        {
+            for (std::size_t j = 0; j < m; ++j)
+            {
+                A(i, j) = dist(rng) + (i == j ? m : 0.0);
+                A_ublas(i, j) = A(i, j);
+            }
+        }
+        Eigen::VectorXd b(m);
+        for (std::size_t i = 0; i < m; ++i) b[i] = dist(rng);
+
+        auto start = Clock::now();
+        boost_matrix A_inv(m, m);
+        ublas_inv(A_ublas, A_inv);
+        double setup_ublas = seconds(start);
+
+        start = Clock::now();
+        Eigen::PartialPivLU<Eigen::MatrixXd> lu(A);
+        double setup_eigen = seconds(start);
+
+        std::vector<double> x_ublas(m);
+        start = Clock::now();
+        for (std::size_t s = 0; s < steps; ++s)
+        {
+            for (std::size_t i = 0; i < m; ++i)
+            {
+                double sum = 0.0;
+                for (std::size_t j = 0; j < m; ++j)
+                {
+                    sum += A_inv(i, j) * b[j];
+                }
+                x_ublas[i] = sum;
+            }
+        }
+        double step_ublas = seconds(start) / steps;
+
+        Eigen::VectorXd x_eigen;
+        start = Clock::now();
+        for (std::size_t s = 0; s < steps; ++s)
+        {
+            x_eigen = lu.solve(b);
+        }
+        double step_eigen = seconds(start) / steps;
+
+        double diff = 0.0;
+        for (std::size_t i = 0; i < m; ++i)
+        {
+            diff = std::max(diff, std::abs(x_ublas[i] - x_eigen[i]));
+        }
+
+        std::cout << std::setw(8) << n
+                  << std::setw(16) << setup_ublas
+                  << std::setw(16) << setup_eigen
+                  << std::setw(16) << step_ublas
+                  << std::setw(16) << step_eigen
+                  << std::setw(16) << diff << std::endl;
+    }
+    return 0;
+}
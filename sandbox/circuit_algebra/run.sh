@@ -0,0 +1,3 @@
+#!/bin/bash
+rm -rf build
+mkdir -p build && cd build && cmake .. && make && ./benchmark
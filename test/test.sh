@@ -1,8 +1,6 @@
 # Very crude integration test. Runs a simulation that is known to have a small
-# relative error and checks that this is indeed true. Since PUNC++
-# unfortunately do not have an option to use the same seed each time, it is
-# theoretically possible that this test fails when nothing is wrong. If it
-# fails, try again. If it fails again, something is wrong.
+# relative error and checks that this is indeed true. The simulation is run
+# with a fixed seed, such that the result is reproducible.
 #
 # For Anaconda users: the makefile assumes the dolfin-convert and gmsh commands
 # to both work from the current environment. If that's not the case, bypass
@@ -24,7 +22,7 @@ cd ../test
 rm -f *.dat
 ln -sf ../interaction/build/interaction
 echo "inspect result with: mpl history.dat \"truth(-0.136,0.03)(ema(1e-6)(I[0]))\""
-./interaction test.ini
+./interaction test.ini --seed 1
 
 # Test simulation results 
 ./test.py